@@ -0,0 +1,344 @@
+/*
+ * bench.c - microbenchmarks of single paths of the allocator
+ *
+ *   bench [-n <requests>] [-k <runs>] [-t <live blocks>] [-c <cpu>] [name...]
+ *
+ * Traces mix every path of the allocator, so a regression of one of them is
+ * hard to see in their times. Each benchmark here makes the same kind of
+ * request over and over: malloc and free of one size, the same with a sized
+ * free, churn of a live set in LIFO or FIFO order, realloc that doubles a
+ * block, malloc that has to skip a bucket full of free blocks that are too
+ * small, and calloc of large blocks.
+ * Every one of them runs on a fresh heap k times, and the fastest, median and
+ * standard deviation of the time per request are printed with the heap
+ * utilization, the peak of the live payload over the peak heap size. Names
+ * on the command line select the benchmarks that start with them.
+ */
+#define _GNU_SOURCE
+#include <math.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "memlib.h"
+#include "mm.h"
+
+/* Parameters from the command line */
+static size_t num_requests = 1000000; /* per run, roughly */
+static int runs = 11;
+static size_t target = 1000; /* live blocks of the churn and fragment runs */
+
+static void app_error(const char *fmt, ...)
+  __attribute__((format(printf, 1, 2), noreturn));
+
+/* --=[ random numbers ]=--------------------------------------------------- */
+
+static uint64_t rng_state;
+
+/* xorshift64*, the same as tracegen */
+static inline uint64_t rng(void) {
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+/* --=[ live payload ]=----------------------------------------------------- */
+
+static size_t live, peak; /* payload bytes allocated now, and at most */
+
+static inline void *bench_malloc(size_t size) {
+  void *ptr = mm_malloc(size);
+  if (ptr == NULL)
+    app_error("mm_malloc(%zu) failed\n", size);
+  if ((live += size) > peak)
+    peak = live;
+  return ptr;
+}
+
+static inline void bench_free(void *ptr, size_t size) {
+  mm_free(ptr);
+  live -= size;
+}
+
+/* Blocks of the live set, reused by every run */
+static void **blocks;
+static size_t *sizes;
+
+/* --=[ benchmarks ]=------------------------------------------------------- */
+/* Each one makes about num_requests requests and returns how many it made */
+
+/* malloc and free of one size, always served by the same free block */
+static size_t pingpong(size_t size) {
+  for (size_t i = 0; i < num_requests / 2; i++)
+    bench_free(bench_malloc(size), size);
+  return num_requests / 2 * 2;
+}
+
+/* The same with mm_free_sized */
+static size_t pingpong_sized(size_t size) {
+  for (size_t i = 0; i < num_requests / 2; i++) {
+    mm_free_sized(bench_malloc(size), size);
+    live -= size;
+  }
+  return num_requests / 2 * 2;
+}
+
+/* Keep target blocks of 16 to 512 bytes live, replacing the newest (LIFO) or
+ * the oldest (FIFO) one with a block of a new size */
+static size_t churn(size_t fifo) {
+  for (size_t i = 0; i < target; i++) {
+    sizes[i] = 16 + rng() % 497;
+    blocks[i] = bench_malloc(sizes[i]);
+  }
+
+  size_t steps = (num_requests - 2 * target) / 2;
+  for (size_t i = 0; i < steps; i++) {
+    size_t j = fifo ? i % target : target - 1;
+    bench_free(blocks[j], sizes[j]);
+    sizes[j] = 16 + rng() % 497;
+    blocks[j] = bench_malloc(sizes[j]);
+  }
+
+  for (size_t i = 0; i < target; i++)
+    bench_free(blocks[i], sizes[i]);
+  return 2 * target + 2 * steps;
+}
+
+/* Grow a block from 16 bytes to max_size by doubling, with a small block
+ * allocated after each realloc, so it can't simply keep growing at the end of
+ * the heap */
+static size_t realloc_double(size_t max_size) {
+  size_t requests = 0;
+
+  while (requests < num_requests) {
+    size_t n = 0, size = 16;
+    void *ptr = bench_malloc(size);
+    while (size < max_size) {
+      ptr = mm_realloc(ptr, 2 * size);
+      if (ptr == NULL)
+        app_error("mm_realloc(%zu) failed\n", 2 * size);
+      live += size;
+      size *= 2;
+      if (live > peak)
+        peak = live;
+      blocks[n++] = bench_malloc(16);
+    }
+    bench_free(ptr, size);
+    for (size_t i = 0; i < n; i++)
+      bench_free(blocks[i], 16);
+    requests += 3 * n + 2;
+  }
+  return requests;
+}
+
+/* Leave target free blocks of 520 bytes between used ones, then allocate
+ * blocks of size bytes. Those fall in the same bucket, so every malloc looks
+ * at all the free blocks there before it takes one from a bigger bucket,
+ * which makes it slow enough for a sixteenth of the requests. */
+#define HOLE_SIZE 520
+#define FRAGMENT_BATCH 64
+
+static size_t fragment(size_t size) {
+  for (size_t i = 0; i < target; i++) {
+    blocks[2 * i] = bench_malloc(HOLE_SIZE);
+    blocks[2 * i + 1] = bench_malloc(16);
+  }
+  for (size_t i = 0; i < target; i++)
+    bench_free(blocks[2 * i], HOLE_SIZE);
+
+  void **batch = blocks + 2 * target;
+  size_t rounds = num_requests / 16 / (2 * FRAGMENT_BATCH);
+  for (size_t r = 0; r < rounds; r++) {
+    for (size_t i = 0; i < FRAGMENT_BATCH; i++)
+      batch[i] = bench_malloc(size);
+    for (size_t i = 0; i < FRAGMENT_BATCH; i++)
+      bench_free(batch[i], size);
+  }
+
+  for (size_t i = 0; i < target; i++)
+    bench_free(blocks[2 * i + 1], 16);
+  return 3 * target + 2 * FRAGMENT_BATCH * rounds;
+}
+
+/* calloc and free of one large size. Each calloc costs as much as clearing
+ * size bytes, so there are fewer requests. */
+static size_t calloc_free(size_t size) {
+  size_t n = num_requests / (size >> 12);
+  if (n < 2)
+    n = 2;
+  for (size_t i = 0; i < n / 2; i++) {
+    char *ptr = mm_calloc(1, size);
+    if (ptr == NULL)
+      app_error("mm_calloc(%zu) failed\n", size);
+    if ((live += size) > peak)
+      peak = live;
+    ptr[size / 2] = 1; /* the pages are used, as they would be */
+    bench_free(ptr, size);
+  }
+  return n / 2 * 2;
+}
+
+typedef struct {
+  const char *name;
+  size_t (*run)(size_t arg);
+  size_t arg;
+} bench_t;
+
+static const bench_t benchmarks[] = {
+  {"pingpong-16", pingpong, 16},
+  {"pingpong-64", pingpong, 64},
+  {"pingpong-256", pingpong, 256},
+  {"pingpong-1024", pingpong, 1024},
+  {"pingpong-4096", pingpong, 4096},
+  {"pingpong-16384", pingpong, 16384},
+  {"sized-16", pingpong_sized, 16},
+  {"sized-1024", pingpong_sized, 1024},
+  {"churn-lifo", churn, 0},
+  {"churn-fifo", churn, 1},
+  {"realloc-double", realloc_double, 1 << 20},
+  {"fragment", fragment, 1000},
+  {"calloc-1M", calloc_free, 1 << 20},
+  {"calloc-16M", calloc_free, 16 << 20},
+};
+
+#define NUM_BENCHMARKS (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+/* --=[ measurements ]=----------------------------------------------------- */
+
+static int cmp_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+/* Run the benchmark on a fresh heap, and return the nanoseconds per request */
+static double run_once(const bench_t *b, size_t *requests) {
+  struct timespec start, end;
+
+  mem_reset_brk();
+  if (mm_init() < 0)
+    app_error("mm_init failed\n");
+  rng_state = 0x9E3779B97F4A7C15ULL;
+  live = peak = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  *requests = b->run(b->arg);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  return ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) /
+         *requests;
+}
+
+/* Run the benchmark once to warm up, then runs times, and print the times */
+static void measure(const bench_t *b) {
+  double ns[runs], sum = 0, sq = 0;
+  size_t requests;
+
+  run_once(b, &requests);
+  for (int i = 0; i < runs; i++)
+    sum += ns[i] = run_once(b, &requests);
+  qsort(ns, runs, sizeof(double), cmp_double);
+  for (int i = 0; i < runs; i++)
+    sq += (ns[i] - sum / runs) * (ns[i] - sum / runs);
+
+  double median =
+    runs % 2 ? ns[runs / 2] : (ns[runs / 2 - 1] + ns[runs / 2]) / 2;
+  printf("%-16s %10zu %9.1f %9.1f %9.1f %7.1f%%\n", b->name, requests, ns[0],
+         median, sqrt(sq / runs), 100.0 * peak / mem_peak_heapsize());
+}
+
+/* --=[ main ]=------------------------------------------------------------- */
+
+static void usage(void) {
+  fprintf(stderr,
+          "Usage: bench [-n <requests>] [-k <runs>] [-t <live blocks>] "
+          "[-c <cpu>] [name...]\n"
+          "\t-n <i>   Requests of each run, roughly (default 1000000).\n"
+          "\t-k <i>   Timed runs of each benchmark (default 11).\n"
+          "\t-t <i>   Live blocks of churn and fragment (default 1000).\n"
+          "\t-c <i>   Pin to CPU <i>.\n"
+          "\t-l       List the benchmarks.\n"
+          "Names run the benchmarks that start with them, all by default.\n");
+}
+
+int main(int argc, char **argv) {
+  int c;
+
+  while ((c = getopt(argc, argv, "n:k:t:c:lh")) != -1) {
+    switch (c) {
+      case 'n':
+        num_requests = strtoull(optarg, NULL, 0);
+        break;
+
+      case 'k':
+        runs = atoi(optarg);
+        if (runs < 1)
+          app_error("-k must be positive\n");
+        break;
+
+      case 't':
+        target = strtoull(optarg, NULL, 0);
+        if (target == 0)
+          app_error("-t must be positive\n");
+        break;
+
+      case 'c': {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(atoi(optarg), &cpus);
+        if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0)
+          app_error("sched_setaffinity failed\n");
+        break;
+      }
+
+      case 'l':
+        for (size_t i = 0; i < NUM_BENCHMARKS; i++)
+          printf("%s\n", benchmarks[i].name);
+        return EXIT_SUCCESS;
+
+      case 'h':
+        usage();
+        return EXIT_SUCCESS;
+
+      default:
+        usage();
+        return EXIT_FAILURE;
+    }
+  }
+
+  if (num_requests < 4 * target)
+    app_error("-n must be at least %zu with -t %zu\n", 4 * target, target);
+  if ((blocks = malloc((2 * target + FRAGMENT_BATCH) * sizeof(void *))) ==
+        NULL ||
+      (sizes = malloc(target * sizeof(size_t))) == NULL)
+    app_error("out of memory\n");
+
+  mem_max_heap(mm_allocator.max_heap);
+  mem_init();
+
+  printf("%-16s %10s %9s %9s %9s %8s\n", "benchmark", "requests", "min ns",
+         "median ns", "stddev", "util");
+  for (size_t i = 0; i < NUM_BENCHMARKS; i++) {
+    int selected = optind == argc;
+    for (int j = optind; j < argc && !selected; j++)
+      selected = strncmp(benchmarks[i].name, argv[j], strlen(argv[j])) == 0;
+    if (selected)
+      measure(&benchmarks[i]);
+  }
+
+  mem_deinit();
+  return EXIT_SUCCESS;
+}
+
+static void app_error(const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+  exit(EXIT_FAILURE);
+}
@@ -1,13 +1,23 @@
 #!/usr/bin/env python3
 
-import math
+import argparse
+import concurrent.futures
+import json
+import os
+import queue
 import signal
 import subprocess
 import sys
+import tempfile
 
 
-STUDENT_DEFINED = ['mm_calloc', 'mm_checkheap', 'mm_free', 'mm_init',
-                   'mm_malloc', 'mm_realloc']
+STUDENT_DEFINED = ['mm_aligned_alloc', 'mm_allocator', 'mm_calloc',
+                   'mm_checkheap', 'mm_fit_policy', 'mm_free',
+                   'mm_free_batch', 'mm_free_order', 'mm_free_sized',
+                   'mm_grow_percent', 'mm_init', 'mm_malloc',
+                   'mm_malloc_batch', 'mm_memalign', 'mm_posix_memalign',
+                   'mm_quick_limit', 'mm_realloc', 'mm_realloc_reserve',
+                   'mm_stats', 'mm_usable_size']
 
 
 MINUTIL = 60
@@ -75,22 +85,32 @@ TRACEFILES_EXTRA = [
         "traces-private/seglist.rep"]
 
 
-def runtrace(trace):
-    mdriver = subprocess.run([
-        "valgrind",
-        "--tool=callgrind",
-        "--callgrind-out-file=callgrind.out",
-        "--toggle-collect=mm_malloc",
-        "--toggle-collect=mm_free",
-        "--toggle-collect=mm_realloc",
-        "--toggle-collect=mm_calloc",
-        "--", "./mdriver", "-f", trace],
-        capture_output=True, timeout=TIMEOUT)
+def parse_results(output):
+    """Return util, used, total, ops, secs and Kops from the results table of
+    mdriver."""
+    lines = output.splitlines()
+    for i, line in enumerate(lines[:-1]):
+        if line.split()[:2] == ['valid', 'util']:
+            stats = lines[i + 1][4:].split()
+            try:
+                return (float(stats[1][:-1]), int(stats[2]), int(stats[3]),
+                        int(stats[4]), float(stats[5]), float(stats[6]))
+            except (ValueError, IndexError):
+                break
+    print(output)
+    raise SystemExit("Reading statistics from 'mdriver' has failed :( "
+                     "This is a bug - please report it!")
+
+
+def run_mdriver(cmd):
+    """Run mdriver, and return its output once it is known to have run the
+    trace correctly."""
+    mdriver = subprocess.run(cmd, capture_output=True, timeout=TIMEOUT)
 
     output = mdriver.stdout.decode()
-    print(output)
 
     if any(line.startswith('ERROR') for line in output.splitlines()):
+        print(output)
         raise SystemExit("Your solution is incorrect - check messages above!")
 
     if mdriver.returncode < 0:
@@ -98,22 +118,29 @@ def runtrace(trace):
         raise SystemExit(f"Your solution has been terminated by {signame}!")
 
     if mdriver.returncode > 0:
+        print(output)
         raise SystemExit(f"Your solution has exited abnormally "
                          f"with status {mdriver.returncode}!")
 
-    # Process statistics from mdriver
-    stats = mdriver.stdout.decode().splitlines()[3][4:].split()
-    try:
-        util = float(stats[1][:-1])
-        used = int(stats[2])
-        total = int(stats[3])
-    except ValueError:
-        print(stats)
-        raise SystemExit("Reading statistics from 'mdriver' has failed :( "
-                         "This is a bug - please report it!")
+    return output
+
+
+def runtrace(trace, cpu, outdir):
+    """Count the instructions of the allocator on the trace with callgrind.
+    Returns the output of mdriver and callgrind_annotate, and the count."""
+    outfile = os.path.join(outdir, os.path.basename(trace) + '.callgrind')
+    output = run_mdriver([
+        "valgrind",
+        "--tool=callgrind",
+        f"--callgrind-out-file={outfile}",
+        "--toggle-collect=mm_malloc",
+        "--toggle-collect=mm_free",
+        "--toggle-collect=mm_realloc",
+        "--toggle-collect=mm_calloc",
+        "--", "./mdriver", "-c", str(cpu), "-f", trace])
 
     annotate = subprocess.run([
-        "callgrind_annotate", "--tree=calling", "callgrind.out"],
+        "callgrind_annotate", "--tree=calling", outfile],
         capture_output=True)
 
     # Process output from callgrind_annotate
@@ -121,15 +148,84 @@ def runtrace(trace):
     show = 10000
     for i, line in enumerate(annotate.stdout.decode().splitlines()):
         if i >= show and line:
-            print(line)
+            output += line + '\n'
         if 'PROGRAM TOTALS' in line:
             insn = int(line.strip().split()[0].replace(',', ''))
         if 'file:function' in line:
             show = i + 3
 
-    sys.stdout.flush()
+    return output, insn
+
+
+def timetrace(trace, cpu, runs):
+    """Time the trace natively, and measure the latency of every request
+    type. Returns the output of mdriver and the measurements."""
+    output = run_mdriver(["./mdriver", "-c", str(cpu), "-k", str(runs), "-P",
+                          "-f", trace])
+    util, used, total, ops, secs, kops = parse_results(output)
+    result = {'util': util, 'used': used, 'total': total, 'counters': {}}
+
+    # The table has the fastest run, the timing line below the median, but
+    # mdriver prints that line only for more than one run. Kops has more
+    # digits than the secs of a short trace.
+    if kops > 0:
+        secs = ops / (kops * 1000)
+    result['secs'] = result['secs_median'] = secs
+    result['ops_per_sec'] = kops * 1000
+
+    for line in output.splitlines():
+        fs = line.split()
+        if fs[:1] == ['timing:']:
+            result['secs'] = float(fs[4]) / 1e6
+            result['secs_median'] = float(fs[6]) / 1e6
+            result['ops_per_sec'] = float(fs[10])  # median run
+        elif fs[:2] == ['per', 'request:']:
+            for name, value in zip(fs[2::2], fs[3::2]):
+                result['counters'][name] = \
+                    None if value == 'n/a' else float(value)
+
+    latency = run_mdriver(["./mdriver", "-c", str(cpu), "-L", "0",
+                           "-f", trace])
+    result['latency'] = {}
+    rows = False
+    for line in latency.splitlines():
+        fs = line.split()
+        if fs[:2] == ['latency', '(ns)']:
+            keys = fs[2:]
+            rows = True
+        elif rows and len(fs) == len(keys) + 1 and fs[1].isdigit():
+            result['latency'][fs[0]] = dict(zip(keys, map(int, fs[1:])))
+        else:
+            rows = False
+
+    return output, result
+
 
-    return util, insn, used, total
+def grade_trace(trace, args, cpus, outdir):
+    """Run all measurements of one trace on a cpu of its own."""
+    cpu = cpus.get()
+    try:
+        with open(trace, "r") as f:
+            _ = int(f.readline())
+            _ = int(f.readline())
+            ops = int(f.readline())
+
+        # Penalties for timeout
+        result = {'ops': ops, 'util': 0.0, 'used': 0, 'total': 0,
+                  'insn': 50000 * ops}
+        output = ''
+        try:
+            output, timing = timetrace(trace, cpu, args.runs)
+            result.update(timing)
+            if args.callgrind:
+                output, result['insn'] = runtrace(trace, cpu, outdir)
+            else:
+                result['insn'] = None
+        except subprocess.TimeoutExpired:
+            output += "Penalty accrued for timeout of %ds.\n" % TIMEOUT
+        return output, result
+    finally:
+        cpus.put(cpu)
 
 
 def check_symbols():
@@ -160,52 +256,135 @@ def check_sections():
         raise SystemExit("Your solution was disqualified! :(")
 
 
-if __name__ == '__main__':
-    check_symbols()
-    check_sections()
+def summarize(results):
+    """Add the grade of the solution to the results of all the traces."""
+    traces = results['traces'].values()
+    all_ops = sum(r['ops'] for r in traces)
+
+    results['weighted_util'] = sum(r['util'] * r['ops'] / all_ops
+                                   for r in traces)
+    total = sum(r['total'] for r in traces)
+    results['total_util'] = (100.0 * sum(r['used'] for r in traces) / total
+                             if total else 0.0)
+    secs = sum(r.get('secs', 0) for r in traces)
+    results['ops_per_sec'] = all_ops / secs if secs else 0.0
+    if all(r['insn'] is not None for r in traces):
+        results['insn_per_op'] = sum(r['insn'] for r in traces) / all_ops
+
+
+def compare(results, baseline, tolerance, util_tolerance):
+    """Print how the results changed since the baseline, and return the number
+    of regressions: utilization lower by more than util_tolerance points, or
+    throughput and instruction counts worse by more than tolerance percent.
+    Most traces run for microseconds, so only the throughput of all of them
+    together is steady enough to fail on."""
+    regressions = 0
+
+    def check(name, metric, old, new, worse, gate=True):
+        nonlocal regressions
+        if old is None or new is None:
+            return
+        if metric == 'util':
+            change = new - old
+            bad = -change > util_tolerance
+            text = '%+.1f' % change
+        else:
+            change = 100.0 * (new - old) / old if old else 0.0
+            bad = (change if worse > 0 else -change) > tolerance
+            text = '%+.1f%%' % change
+        bad = bad and gate
+        if bad:
+            regressions += 1
+        print('%-36s %-12s %14.6g %14.6g %9s%s' %
+              (name, metric, old, new, text, '  REGRESSION' if bad else ''))
+
+    print('\n%-36s %-12s %14s %14s %9s' %
+          ('trace', 'metric', 'baseline', 'now', 'change'))
+    for trace, new in results['traces'].items():
+        old = baseline['traces'].get(trace)
+        if old is None:
+            continue
+        check(trace, 'util', old['util'], new['util'], -1)
+        check(trace, 'ops_per_sec', old.get('ops_per_sec'),
+              new.get('ops_per_sec'), -1, gate=False)
+        check(trace, 'insn', old['insn'], new['insn'], 1)
+    check('all', 'util', baseline['weighted_util'], results['weighted_util'],
+          -1)
+    check('all', 'ops_per_sec', baseline['ops_per_sec'],
+          results['ops_per_sec'], -1)
+    check('all', 'insn_per_op', baseline.get('insn_per_op'),
+          results.get('insn_per_op'), 1)
+    return regressions
 
-    all_ops = []
-    all_insn = []
-    all_util = []
-    all_used = []
-    all_total = []
 
-    for trace in TRACEFILES:
-        print("\nRunning mdriver for '%s'..." % trace)
-
-        with open(trace, "r") as f:
-            _ = int(f.readline())
-            _ = int(f.readline())
-            ops = int(f.readline())
-
-        util = 0.0              # default utilization penalty for timeout
-        insn = 50000.0 * ops    # default throughput penalty for timeout
-        heapsz = math.inf
-
-        try:
-            util, insn, used, total = runtrace(trace)
-        except subprocess.TimeoutExpired:
-            print("Penalty accrued for timeout of %ds." % TIMEOUT)
-
-        all_insn.append(insn)
-        all_util.append(util)
-        all_ops.append(ops)
-        all_used.append(used)
-        all_total.append(total)
-
-    # Grade solution
-    weighted_util = 0
-    for util, ops in zip(all_util, all_ops):
-        weighted_util += util * (ops / sum(all_ops))
-
-    total_util = sum(all_used) / sum(all_total)
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(
+        description="Grade the allocator on the traces, each one pinned to a "
+                    "cpu of its own, as many at once as there are cpus.")
+    parser.add_argument('-j', '--jobs', type=int,
+                        help="traces run at once (default: number of cpus)")
+    parser.add_argument('-k', '--runs', type=int, default=11,
+                        help="timed runs of each trace (default: 11)")
+    parser.add_argument('-n', '--no-callgrind', dest='callgrind',
+                        action='store_false',
+                        help="don't count instructions with valgrind")
+    parser.add_argument('--extra', action='store_true',
+                        help="also run the private traces")
+    parser.add_argument('--json', metavar='FILE',
+                        help="write the results of every trace to FILE")
+    parser.add_argument('--compare', metavar='FILE',
+                        help="fail on regressions from the results in FILE")
+    parser.add_argument('--tolerance', type=float, default=5.0,
+                        help="percent of throughput or instructions lost "
+                             "before it is a regression (default: 5)")
+    parser.add_argument('--util-tolerance', type=float, default=0.5,
+                        help="points of utilization lost before it is a "
+                             "regression (default: 0.5)")
+    args = parser.parse_args()
 
-    print("\nWeighted memory utilization: %.1f%%" % weighted_util)
-    print("Total memory utilization: %.2f%%" % (100.0 * total_util))
-    print("Instructions per operation: %d" % (sum(all_insn) / sum(all_ops)))
+    check_symbols()
+    check_sections()
 
-    if weighted_util < MINUTIL:
+    tracefiles = TRACEFILES + (TRACEFILES_EXTRA if args.extra else [])
+    cpus = queue.Queue()
+    allowed = sorted(os.sched_getaffinity(0))
+    jobs = min(args.jobs or len(allowed), len(allowed))
+    for cpu in allowed[:jobs]:
+        cpus.put(cpu)
+
+    results = {'traces': {}}
+    with tempfile.TemporaryDirectory() as outdir, \
+            concurrent.futures.ThreadPoolExecutor(jobs) as executor:
+        runs = executor.map(lambda t: grade_trace(t, args, cpus, outdir),
+                            tracefiles)
+        for trace, (output, result) in zip(tracefiles, runs):
+            print("\nRunning mdriver for '%s'..." % trace)
+            print(output)
+            sys.stdout.flush()
+            results['traces'][trace] = result
+
+    summarize(results)
+    print("\nWeighted memory utilization: %.1f%%" % results['weighted_util'])
+    print("Total memory utilization: %.2f%%" % results['total_util'])
+    print("Throughput: %.0f Kops/sec" % (results['ops_per_sec'] / 1e3))
+    if 'insn_per_op' in results:
+        print("Instructions per operation: %d" % results['insn_per_op'])
+
+    if args.json:
+        with open(args.json, 'w') as f:
+            json.dump(results, f, indent=2)
+            f.write('\n')
+
+    if results['weighted_util'] < MINUTIL:
         print("Minimum threshold for memory utilization "
               "of %d%% has not been met!" % MINUTIL)
         print("Your solution was disqualified! :(")
         sys.exit(1)
+
+    if args.compare:
+        with open(args.compare) as f:
+            regressions = compare(results, json.load(f), args.tolerance,
+                                  args.util_tolerance)
+        if regressions:
+            print("\n%d regressions from '%s'!" % (regressions, args.compare))
+            sys.exit(1)
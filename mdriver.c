@@ -9,21 +9,33 @@
  *
  * WARNING! This file has been heavily modified compared to the original.
  */
+#define _GNU_SOURCE /* sched_setaffinity */
 #include <assert.h>
 #include <errno.h>
 #include <float.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
-#include <sys/time.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
 
 #include "memlib.h"
 #include "mm.h"
+#include "trace.h"
 
 /**********************
  * Constants and macros
@@ -31,6 +43,7 @@
 
 /* Misc */
 #define MAXLINE 1024 /* max string size */
+#define MAX_TRACES 64 /* max traces given with -f */
 /* cnvt trace request nums to linenums (origin 1) */
 #define LINENUM(i) (i + 5)
 
@@ -62,13 +75,6 @@ typedef struct range_t {
   int index;            /* same index as free; for debugging */
 } range_t;
 
-/* Characterizes a single trace operation (allocator request) */
-typedef struct {
-  enum { ALLOC, FREE, REALLOC } type; /* type of request */
-  int index;                          /* index for free() to use later */
-  size_t size;                        /* byte size of alloc/realloc request */
-} traceop_t;
-
 /* Holds the information for one trace file*/
 typedef struct {
   char filename[MAXLINE];
@@ -77,11 +83,57 @@ typedef struct {
   int num_ops;          /* number of distinct requests */
   int weight;           /* weight for this trace (unused) */
   traceop_t *ops;       /* array of requests */
+  void *map;            /* mapping of a binary trace, or NULL */
+  size_t map_len;       /* ... and its length */
   char **blocks;        /* array of ptrs returned by malloc/realloc... */
   size_t *block_sizes;  /* ... and a corresponding array of payload sizes */
   int *block_rand_base; /* index into random_data, if debug is on */
 } trace_t;
 
+/*
+ * Latency of single requests, in nanoseconds. Each request type has a
+ * log-bucketed histogram (as in HDR histograms): every power of two is
+ * split into LAT_SUB buckets, so a bucket is at most 1/LAT_SUB wide
+ * relative to its values.
+ */
+#define LAT_SUB_BITS 3
+#define LAT_SUB (1 << LAT_SUB_BITS)
+#define LAT_BUCKETS (64 << LAT_SUB_BITS)
+
+typedef struct {
+  uint64_t count[NUM_TYPES][LAT_BUCKETS]; /* indexed by traceop_t type */
+  uint64_t num[NUM_TYPES];
+  uint64_t max[NUM_TYPES];
+  uint64_t *op_max; /* slowest time of every request over all runs */
+  int num_slowest;
+  struct {
+    int opnum;
+    traceop_t op;
+    uint64_t ns;
+  } *slowest; /* num_slowest slowest requests */
+} latency_t;
+
+/*
+ * Hardware counters read around the timed runs (set by -P)
+ */
+#define CACHE_MISS(cache)                                                      \
+  ((PERF_COUNT_HW_CACHE_##cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) |        \
+   (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static const struct {
+  const char *name;
+  uint32_t type;
+  uint64_t config;
+} counters[] = {
+  {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+  {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+  {"L1d-misses", PERF_TYPE_HW_CACHE, CACHE_MISS(L1D)},
+  {"LLC-misses", PERF_TYPE_HW_CACHE, CACHE_MISS(LL)},
+  {"dTLB-misses", PERF_TYPE_HW_CACHE, CACHE_MISS(DTLB)},
+  {"branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+};
+#define NUM_COUNTERS (int)(sizeof(counters) / sizeof(counters[0]))
+
 /*
  * Holds the params to the xxx_speed functions, which are timed by fcyc.
  * This struct is necessary because fcyc accepts only a pointer array
@@ -90,8 +142,30 @@ typedef struct {
 typedef struct {
   trace_t *trace;
   range_t *ranges;
+  latency_t *latency; /* if not NULL, time every request */
 } speed_t;
 
+/*
+ * One thread of a multi-threaded replay (-t). With -x, the blocks it frees
+ * go through a single-producer, single-consumer ring to the next thread,
+ * which does the freeing.
+ */
+#define QUEUE_LEN 1024 /* a power of two */
+
+typedef struct worker {
+  trace_t *trace;        /* a trace, or one shard of it, of this thread */
+  range_t **ranges;      /* shared by all threads */
+  latency_t *latency;    /* if not NULL, time every request */
+  pthread_t thread;
+  int valid;             /* set by the validity run */
+  uint64_t start, end;   /* in ns, of the last run */
+  struct worker *next;   /* frees our blocks (-x) ... */
+  struct worker *prev;   /* ... and we free the blocks of this one */
+  atomic_int done;       /* no more blocks will be handed over */
+  atomic_uint head, tail;
+  void *queue[QUEUE_LEN];
+} worker_t;
+
 /* Summarizes the important stats for some malloc function on some trace */
 typedef struct {
   /* set in read_trace */
@@ -101,12 +175,20 @@ typedef struct {
 
   /* run-time stats defined for both libc and student */
   int valid;   /* was the trace processed correctly by the allocator? */
-  double secs; /* number of secs needed to run the trace */
+  double secs; /* number of secs needed to run the trace (fastest run) */
+  int runs;    /* number of timed runs */
+  double secs_median, secs_stddev; /* over all timed runs */
+  latency_t *latency;              /* set by -L */
+  int perf_valid;                  /* counters were read (-P) */
+  double perf[NUM_COUNTERS];       /* per request, negative if n/a */
+#ifdef STATS
+  mm_stats_t alloc; /* counters of the allocator, for one replay */
+#endif
 
   /* defined only for the student malloc package */
   double util; /* space utilization for this trace (always 0 for libc) */
-  int used;    /* maximum bytes used by allocated blocks */
-  int total;   /* total heap size */
+  size_t used;  /* maximum bytes used by allocated blocks */
+  size_t total; /* total heap size */
 
   /* Note: secs and util are only defined if valid is true */
 } stats_t;
@@ -132,6 +214,18 @@ static enum { DBG_NONE, DBG_CHEAP, DBG_EXPENSIVE } debug_mode = DBG_CHEAP;
 
 static int verbose = 1; /* global flag for verbose output */
 
+static int timed_runs = 1;  /* times each trace is timed (set by -k) */
+static int warmup_runs = -1; /* untimed runs before that (-w, 1 with -k) */
+static int num_slowest = -1; /* slowest requests to list, -1 if no -L */
+static int perf_fd[NUM_COUNTERS]; /* -1 for counters that can't be used */
+static int use_perf = 0;        /* set by -P */
+static int num_threads = 0;     /* replay threads (set by -t), 0 if none */
+static int cross_free = 0;      /* free on the next thread (set by -x) */
+static int sized_free = 0;      /* free with mm_free_sized (set by -z) */
+static const mm_allocator_t *mm = &mm_allocator; /* mm64 with layout -W */
+static atomic_int replay_failed; /* a thread found an error */
+static pthread_mutex_t range_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /*********************
  * Function prototypes
  *********************/
@@ -145,6 +239,7 @@ static void clear_ranges(range_t **ranges);
 /* These functions implement the debugging code */
 static void init_random_data(void);
 static void check_index(const trace_t *trace, int opnum, int index);
+static int check_usable(const trace_t *trace, int opnum, int index);
 static void randomize_block(trace_t *trace, int index);
 
 /* These functions read, allocate, and free storage for traces */
@@ -159,11 +254,26 @@ static void eval_libc_speed(void *ptr);
 /* Routines for evaluating correctnes, space utilization, and speed
    of the student's malloc package in mm.c */
 static int eval_mm_valid(trace_t *trace, range_t **ranges);
-static double eval_mm_util(trace_t *trace, int *used_p, int *total_p);
+static int valid_requests(trace_t *trace, range_t **ranges, worker_t *w);
+static double eval_mm_util(trace_t *trace, size_t *used_p, size_t *total_p);
 static void eval_mm_speed(void *ptr);
+static void speed_requests(trace_t *trace, latency_t *lat, worker_t *w);
+
+/* These functions replay traces on many threads at once */
+static void hand_over(worker_t *w, void *block);
+static void drain_frees(worker_t *w);
 
 /* Various helper routines */
 static void printresults(stats_t *stats);
+static void print_coalescing(stats_t *eager, stats_t *deferred);
+static void print_layouts(stats_t *compact, stats_t *wide);
+static void print_backing(void);
+static void print_placement(stats_t m[NUM_FIT_POLICIES][NUM_FREE_ORDERS]);
+static void print_latency(latency_t *lat);
+#ifdef STATS
+static void read_alloc_stats(mm_stats_t *alloc);
+static void print_alloc_stats(mm_stats_t *alloc);
+#endif
 static void usage(void);
 static void malloc_error(const trace_t *trace, int opnum, const char *fmt, ...)
   __attribute__((format(printf, 3, 4)));
@@ -182,14 +292,212 @@ typedef void (*fsecs_test_funct)(void *);
  * fsecs - Return the running time of a function f (in seconds)
  */
 static double fsecs(fsecs_test_funct f, void *argp) {
-  struct timeval stv, etv;
-  double diff;
+  struct timespec stv, etv;
 
-  gettimeofday(&stv, NULL);
+  clock_gettime(CLOCK_MONOTONIC, &stv);
   f(argp);
-  gettimeofday(&etv, NULL);
-  diff = 1E3 * (etv.tv_sec - stv.tv_sec) + 1E-3 * (etv.tv_usec - stv.tv_usec);
-  return (1E-3 * diff);
+  clock_gettime(CLOCK_MONOTONIC, &etv);
+  return (etv.tv_sec - stv.tv_sec) + 1E-9 * (etv.tv_nsec - stv.tv_nsec);
+}
+
+/*
+ * now_ns - Return the monotonic time in nanoseconds
+ */
+static inline uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * lat_bucket - Return the histogram bucket of a latency
+ */
+static inline int lat_bucket(uint64_t ns) {
+  if (ns < LAT_SUB)
+    return ns;
+  int msb = 63 - __builtin_clzll(ns);
+  return ((msb - LAT_SUB_BITS + 1) << LAT_SUB_BITS) +
+         ((ns >> (msb - LAT_SUB_BITS)) & (LAT_SUB - 1));
+}
+
+/*
+ * lat_bucket_max - Return the largest latency that falls into a bucket
+ */
+static uint64_t lat_bucket_max(int bucket) {
+  if (bucket < LAT_SUB)
+    return bucket;
+  int shift = (bucket >> LAT_SUB_BITS) - 1;
+  uint64_t lo = (uint64_t)(LAT_SUB + (bucket & (LAT_SUB - 1))) << shift;
+  return lo + ((uint64_t)1 << shift) - 1;
+}
+
+/*
+ * lat_record - Account one request that took ns nanoseconds
+ */
+static inline void lat_record(latency_t *lat, int opnum, int type,
+                              uint64_t ns) {
+  lat->count[type][lat_bucket(ns)]++;
+  lat->num[type]++;
+  if (ns > lat->max[type])
+    lat->max[type] = ns;
+  if (ns > lat->op_max[opnum])
+    lat->op_max[opnum] = ns;
+}
+
+/*
+ * lat_percentile - Return the latency below which a fraction p of the
+ *     requests of the type fall (rounded up to the bucket bound)
+ */
+static uint64_t lat_percentile(latency_t *lat, int type, double p) {
+  uint64_t rank = (uint64_t)ceil(p * lat->num[type]);
+  uint64_t seen = 0;
+
+  for (int b = 0; b < LAT_BUCKETS; b++) {
+    seen += lat->count[type][b];
+    if (seen >= rank && seen > 0)
+      return lat_bucket_max(b) < lat->max[type] ? lat_bucket_max(b)
+                                                : lat->max[type];
+  }
+  return lat->max[type];
+}
+
+/*
+ * lat_slowest - Pick the num_slowest slowest requests of the trace
+ */
+static void lat_slowest(latency_t *lat, trace_t *trace) {
+  lat->slowest = calloc(num_slowest + 1, sizeof(*lat->slowest));
+  if (lat->slowest == NULL)
+    unix_error("malloc error in lat_slowest");
+
+  /* insertion into the list sorted from the slowest */
+  lat->num_slowest = 0;
+  for (int i = 0; i < trace->num_ops; i++) {
+    uint64_t ns = lat->op_max[i];
+    if (lat->num_slowest == num_slowest &&
+        (num_slowest == 0 || ns <= lat->slowest[num_slowest - 1].ns))
+      continue;
+
+    int j = lat->num_slowest < num_slowest ? lat->num_slowest++
+                                           : num_slowest - 1;
+    while (j > 0 && lat->slowest[j - 1].ns < ns) {
+      lat->slowest[j] = lat->slowest[j - 1];
+      j--;
+    }
+    lat->slowest[j].opnum = i;
+    lat->slowest[j].op = trace->ops[i];
+    lat->slowest[j].ns = ns;
+  }
+}
+
+/*
+ * perf_open - Open the hardware counters, disabled. Counters that are not
+ *     available are skipped, and if there are none, -P is ignored.
+ */
+static void perf_open(void) {
+  int opened = 0;
+
+  for (int i = 0; i < NUM_COUNTERS; i++) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = counters[i].type;
+    attr.config = counters[i].config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.inherit = 1; /* count the replay threads of -t too */
+    attr.read_format =
+      PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    perf_fd[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (perf_fd[i] >= 0)
+      opened++;
+  }
+
+  if (opened == 0) {
+    fprintf(stderr, "Hardware counters are not available (%s), "
+                    "ignoring -P.\n", strerror(errno));
+    use_perf = 0;
+  }
+}
+
+/*
+ * perf_start, perf_stop - Count events between the two calls, and record
+ *     their number per request of the trace
+ */
+static void perf_start(void) {
+  for (int i = 0; i < NUM_COUNTERS; i++) {
+    if (perf_fd[i] >= 0) {
+      ioctl(perf_fd[i], PERF_EVENT_IOC_RESET, 0);
+      ioctl(perf_fd[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+  }
+}
+
+static void perf_stop(stats_t *stats, double requests) {
+  for (int i = 0; i < NUM_COUNTERS; i++) {
+    uint64_t value[3]; /* count, time enabled, time running */
+    stats->perf[i] = -1;
+    if (perf_fd[i] < 0)
+      continue;
+    ioctl(perf_fd[i], PERF_EVENT_IOC_DISABLE, 0);
+    if (read(perf_fd[i], value, sizeof(value)) != sizeof(value) ||
+        value[2] == 0)
+      continue;
+    /* scale up, if the counter had to share the hardware with others */
+    stats->perf[i] = (double)value[0] * value[1] / value[2] / requests;
+  }
+  stats->perf_valid = 1;
+}
+
+static void summarize_runs(double *secs, stats_t *stats);
+
+static int cmp_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+/*
+ * time_runs - Run f warmup_runs times, then time it timed_runs times, and
+ *     record the fastest time, the median and the standard deviation
+ */
+static void time_runs(fsecs_test_funct f, void *argp, stats_t *stats) {
+  double *secs = malloc(timed_runs * sizeof(double));
+
+  if (secs == NULL)
+    unix_error("malloc error in time_runs");
+
+  for (int i = 0; i < warmup_runs; i++)
+    f(argp);
+  if (use_perf)
+    perf_start();
+  for (int i = 0; i < timed_runs; i++)
+    secs[i] = fsecs(f, argp);
+  stats->perf_valid = 0;
+  if (use_perf)
+    perf_stop(stats, stats->ops * timed_runs);
+  summarize_runs(secs, stats);
+}
+
+/*
+ * summarize_runs - Record the fastest of timed_runs times, the median and
+ *     the standard deviation, and free the array
+ */
+static void summarize_runs(double *secs, stats_t *stats) {
+  double sum = 0, sq = 0;
+
+  for (int i = 0; i < timed_runs; i++)
+    sum += secs[i];
+  qsort(secs, timed_runs, sizeof(double), cmp_double);
+  for (int i = 0; i < timed_runs; i++)
+    sq += (secs[i] - sum / timed_runs) * (secs[i] - sum / timed_runs);
+
+  stats->runs = timed_runs;
+  stats->secs = secs[0];
+  stats->secs_median = timed_runs % 2 ? secs[timed_runs / 2]
+                                      : (secs[timed_runs / 2 - 1] +
+                                         secs[timed_runs / 2]) / 2;
+  stats->secs_stddev = sqrt(sq / timed_runs);
+  free(secs);
 }
 
 /* Run the tests; return the number of tests run (may be less than
@@ -198,10 +506,12 @@ static void run_tests(char *tracefile, stats_t *mm_stats, range_t *ranges,
                       speed_t *speed_params) {
   /* initialize simulated memory system in memlib.c *
    * start each trace with a clean system */
+  mem_max_heap(mm->max_heap);
   mem_init();
 
   trace_t *trace;
   trace = read_trace(mm_stats, tracefile);
+  mm_stats->latency = NULL;
   strcpy(mm_stats->filename, trace->filename);
   mm_stats->ops = trace->num_ops;
   if (verbose > 1)
@@ -212,11 +522,30 @@ static void run_tests(char *tracefile, stats_t *mm_stats, range_t *ranges,
     if (verbose > 1)
       printf("efficiency, ");
     mm_stats->util = eval_mm_util(trace, &mm_stats->used, &mm_stats->total);
+#ifdef STATS
+    /* The counters of this replay, the only one without checks or timing */
+    read_alloc_stats(&mm_stats->alloc);
+#endif
     speed_params->trace = trace;
     speed_params->ranges = ranges;
     if (verbose > 1)
       printf("and performance.\n");
-    mm_stats->secs = fsecs(eval_mm_speed, speed_params);
+    speed_params->latency = NULL;
+    time_runs(eval_mm_speed, speed_params, mm_stats);
+
+    /* Time every request in separate runs, so the numbers above are not
+     * affected by the overhead of that */
+    if (num_slowest >= 0) {
+      latency_t *lat = calloc(1, sizeof(latency_t));
+      if (lat == NULL ||
+          (lat->op_max = calloc(trace->num_ops, sizeof(uint64_t))) == NULL)
+        unix_error("malloc error in run_tests");
+      speed_params->latency = lat;
+      for (int i = 0; i < timed_runs; i++)
+        eval_mm_speed(speed_params);
+      lat_slowest(lat, trace);
+      mm_stats->latency = lat;
+    }
   }
 
   free_trace(trace);
@@ -225,16 +554,315 @@ static void run_tests(char *tracefile, stats_t *mm_stats, range_t *ranges,
   mem_deinit();
 }
 
+/*****************************
+ * Multi-threaded replay (-t)
+ *****************************/
+
+/*
+ * hand_over - Pass a block to the next thread, which will free it. While
+ *     its ring is full, free our own incoming blocks, so that a ring of
+ *     threads waiting on each other still makes progress.
+ */
+static void hand_over(worker_t *w, void *block) {
+  worker_t *to = w->next;
+  unsigned tail = atomic_load_explicit(&to->tail, memory_order_relaxed);
+
+  while (tail - atomic_load_explicit(&to->head, memory_order_acquire) ==
+         QUEUE_LEN) {
+    drain_frees(w);
+    sched_yield();
+  }
+  to->queue[tail % QUEUE_LEN] = block;
+  atomic_store_explicit(&to->tail, tail + 1, memory_order_release);
+}
+
+/*
+ * drain_frees - Free the blocks handed over by the previous thread
+ */
+static void drain_frees(worker_t *w) {
+  unsigned head = atomic_load_explicit(&w->head, memory_order_relaxed);
+  unsigned tail = atomic_load_explicit(&w->tail, memory_order_acquire);
+
+  while (head != tail)
+    mm->free(w->queue[head++ % QUEUE_LEN]);
+  atomic_store_explicit(&w->head, head, memory_order_release);
+}
+
+/*
+ * finish_frees - Called when our requests are done: free what the previous
+ *     thread hands over until it is done as well
+ */
+static void finish_frees(worker_t *w) {
+  atomic_store_explicit(&w->done, 1, memory_order_release);
+  if (!cross_free)
+    return;
+  while (!atomic_load_explicit(&w->prev->done, memory_order_acquire)) {
+    drain_frees(w);
+    sched_yield();
+  }
+  drain_frees(w);
+}
+
+static pthread_barrier_t start_barrier;
+
+static void *valid_thread(void *arg) {
+  worker_t *w = arg;
+  pthread_barrier_wait(&start_barrier);
+  w->valid = valid_requests(w->trace, w->ranges, w);
+  if (!w->valid)
+    atomic_store(&replay_failed, 1);
+  finish_frees(w);
+  return NULL;
+}
+
+static void *speed_thread(void *arg) {
+  worker_t *w = arg;
+  pthread_barrier_wait(&start_barrier);
+  w->start = now_ns();
+  speed_requests(w->trace, w->latency, w);
+  finish_frees(w);
+  w->end = now_ns();
+  return NULL;
+}
+
+/*
+ * run_workers - Reset the heap and run every worker on its own thread.
+ *     Threads are new in every run, so that no thread cache of the
+ *     allocator survives mm_init, and start together at a barrier. Returns
+ *     the time from the first start to the last end.
+ */
+static double run_workers(worker_t *workers, void *(*f)(void *)) {
+  mem_reset_brk();
+  if (mm->init() < 0)
+    app_error("mm_init failed in run_workers");
+
+  for (int i = 0; i < num_threads; i++) {
+    worker_t *w = &workers[i];
+    reinit_trace(w->trace);
+    atomic_store(&w->done, 0);
+    atomic_store(&w->head, 0);
+    atomic_store(&w->tail, 0);
+  }
+  pthread_barrier_init(&start_barrier, NULL, num_threads);
+  for (int i = 0; i < num_threads; i++)
+    if (pthread_create(&workers[i].thread, NULL, f, &workers[i]) != 0)
+      unix_error("pthread_create failed in run_workers");
+
+  uint64_t start = UINT64_MAX, end = 0;
+  for (int i = 0; i < num_threads; i++) {
+    pthread_join(workers[i].thread, NULL);
+    start = workers[i].start < start ? workers[i].start : start;
+    end = workers[i].end > end ? workers[i].end : end;
+  }
+  pthread_barrier_destroy(&start_barrier);
+  return (end - start) * 1e-9;
+}
+
+/*
+ * shard_trace - Copy the requests of the blocks with index % n == i. All
+ *     requests of a block stay in one shard, so every shard is a trace.
+ *     Batches are split into single requests.
+ */
+static trace_t *shard_trace(const trace_t *trace, int i, int n) {
+  int max_ops = trace->num_ops + 1;
+  trace_t *shard = malloc(sizeof(trace_t));
+  if (shard == NULL ||
+      (shard->ops = malloc(max_ops * sizeof(traceop_t))) == NULL ||
+      (shard->blocks = calloc(trace->num_ids, sizeof(char *))) == NULL ||
+      (shard->block_sizes = calloc(trace->num_ids, sizeof(size_t))) == NULL ||
+      (shard->block_rand_base =
+         calloc(trace->num_ids, sizeof(*shard->block_rand_base))) == NULL)
+    unix_error("malloc error in shard_trace");
+
+  snprintf(shard->filename, MAXLINE, "%.999s[%d/%d]", trace->filename, i, n);
+  shard->ignore_ranges = trace->ignore_ranges;
+  shard->num_ids = trace->num_ids;
+  shard->weight = trace->weight;
+  shard->map = NULL;
+  shard->num_ops = 0;
+  for (int j = 0; j < trace->num_ops; j++) {
+    traceop_t op = trace->ops[j];
+    int index = op.index;
+    if (op.type != ALLOC_BATCH && op.type != FREE_BATCH) {
+      if ((index >= 0 ? index : j) % n == i)
+        shard->ops[shard->num_ops++] = op;
+      continue;
+    }
+
+    /* The blocks of a batch go to several threads, one by one */
+    op.type = op.type == ALLOC_BATCH ? ALLOC : FREE;
+    for (int id = index; id < index + trace->ops[j].count; id++) {
+      if (id % n != i)
+        continue;
+      if (shard->num_ops == max_ops &&
+          !(shard->ops = realloc(shard->ops, (max_ops *= 2) * sizeof(op))))
+        unix_error("malloc error in shard_trace");
+      op.index = id;
+      op.count = 0;
+      shard->ops[shard->num_ops++] = op;
+    }
+  }
+  return shard;
+}
+
+/*
+ * print_threads - Print the time and the latency percentiles of each thread
+ */
+static void print_threads(worker_t *workers, double *secs) {
+  printf("%8s%8s%10s%7s", "thread", "ops", "secs", "Kops");
+  if (num_slowest >= 0)
+    printf("%8s%8s%10s", "p50", "p99", "max ns");
+  printf("  %s\n", "trace");
+
+  for (int i = 0; i < num_threads; i++) {
+    worker_t *w = &workers[i];
+    printf("%8d%8d%10.6f%7.0f", i, w->trace->num_ops, secs[i],
+           w->trace->num_ops / 1e3 / secs[i]);
+    if (num_slowest >= 0) {
+      /* all request types together */
+      latency_t *lat = w->latency;
+      for (int type = 1; type < NUM_TYPES; type++) {
+        for (int b = 0; b < LAT_BUCKETS; b++)
+          lat->count[0][b] += lat->count[type][b];
+        lat->num[0] += lat->num[type];
+        lat->max[0] = lat->max[type] > lat->max[0] ? lat->max[type]
+                                                   : lat->max[0];
+      }
+      printf("%8lu%8lu%10lu", (unsigned long)lat_percentile(lat, 0, 0.5),
+             (unsigned long)lat_percentile(lat, 0, 0.99),
+             (unsigned long)lat->max[0]);
+    }
+    printf("  %s\n", w->trace->filename);
+  }
+}
+
+/*
+ * run_threads - Replay num_traces traces on num_threads threads at once,
+ *     thread i running trace i % num_traces; a single trace is split into
+ *     shards instead. Checks validity first, then times the replay.
+ */
+static void run_threads(char **tracefiles, int num_traces, stats_t *stats,
+                        range_t *ranges) {
+  worker_t *workers = calloc(num_threads, sizeof(worker_t));
+  double *secs = malloc(timed_runs * sizeof(double));
+  double *thread_secs = malloc(num_threads * sizeof(double));
+  if (workers == NULL || secs == NULL || thread_secs == NULL)
+    unix_error("malloc error in run_threads");
+
+  mem_max_heap(mm->max_heap);
+  mem_init();
+
+  trace_t *whole = NULL;
+  if (num_traces == 1) {
+    whole = read_trace(stats, tracefiles[0]);
+    snprintf(stats->filename, MAXLINE, "%.999s in %d shards", tracefiles[0],
+             num_threads);
+  } else {
+    snprintf(stats->filename, MAXLINE, "%d traces", num_traces);
+  }
+  stats->ops = 0;
+  for (int i = 0; i < num_threads; i++) {
+    stats_t ignore;
+    worker_t *w = &workers[i];
+    w->trace = whole ? shard_trace(whole, i, num_threads)
+                     : read_trace(&ignore, tracefiles[i % num_traces]);
+    w->ranges = &ranges;
+    w->next = &workers[(i + 1) % num_threads];
+    w->prev = &workers[(i + num_threads - 1) % num_threads];
+    stats->ops += w->trace->num_ops;
+  }
+  /* the utilization of threads sharing one heap is not measured */
+  stats->weight = WPERF;
+  stats->latency = NULL;
+  stats->perf_valid = 0;
+
+  if (verbose > 1)
+    printf("Checking mm_malloc for correctness on %d threads, ", num_threads);
+  clear_ranges(&ranges);
+  run_workers(workers, valid_thread);
+  stats->valid = !atomic_load(&replay_failed);
+
+  if (stats->valid) {
+    if (verbose > 1)
+      printf("and performance.\n");
+    for (int i = 0; i < warmup_runs; i++)
+      run_workers(workers, speed_thread);
+    if (use_perf)
+      perf_start();
+
+    /* per thread, keep the times of the fastest run */
+    for (int i = 0; i < timed_runs; i++) {
+      secs[i] = run_workers(workers, speed_thread);
+      if (i == 0 || secs[i] < stats->secs) {
+        stats->secs = secs[i];
+        for (int j = 0; j < num_threads; j++)
+          thread_secs[j] = (workers[j].end - workers[j].start) * 1e-9;
+      }
+    }
+    if (use_perf)
+      perf_stop(stats, stats->ops * timed_runs);
+    summarize_runs(secs, stats);
+
+    /* Time every request in a separate run, as in run_tests */
+    if (num_slowest >= 0) {
+      for (int i = 0; i < num_threads; i++) {
+        latency_t *lat = calloc(1, sizeof(latency_t));
+        if (lat == NULL ||
+            (lat->op_max = calloc(workers[i].trace->num_ops,
+                                  sizeof(uint64_t))) == NULL)
+          unix_error("malloc error in run_threads");
+        workers[i].latency = lat;
+      }
+      run_workers(workers, speed_thread);
+    }
+  }
+
+  if (verbose) {
+    printf("\nResults for mm malloc on %d threads%s:\n", num_threads,
+           cross_free ? ", freeing on the next thread" : "");
+    printresults(stats);
+    if (stats->valid)
+      print_threads(workers, thread_secs);
+  }
+
+  for (int i = 0; i < num_threads; i++) {
+    if (workers[i].latency) {
+      free(workers[i].latency->op_max);
+      free(workers[i].latency);
+    }
+    free_trace(workers[i].trace);
+  }
+  if (whole)
+    free_trace(whole);
+  free(workers);
+  free(thread_secs);
+  mem_deinit();
+}
+
 /**************
  * Main routine
  **************/
 int main(int argc, char **argv) {
   char *tracefile = NULL; /* trace file names */
+  char *tracefiles[MAX_TRACES]; /* all of them, for -t */
+  int num_traces = 0;
   range_t *ranges = NULL; /* keeps track of block extents for one trace */
   stats_t libc_stats;     /* libc stats for trace */
   stats_t mm_stats;       /* mm (i.e. student) stats for trace */
   speed_t speed_params;   /* input parameters to the xx_speed routines */
   int run_libc = 0;       /* If set, run libc malloc (set by -l) */
+  int reserve = -1;       /* Realloc slack in percent (set by -R) */
+  int grow = -1;          /* Heap growth surplus in percent (set by -G) */
+  int quick = 0;          /* Quick list length, deferred coalescing (-Q) */
+  stats_t eager_stats;    /* mm stats with eager coalescing, for -Q */
+  int layouts = 0;        /* Run both heap layouts (set by -W) */
+  stats_t compact_stats;  /* mm stats with the 4-byte layout, for -W */
+  int hugepages = -1;     /* Backing of the heap (set by -H), -1 if no -H */
+  int policy = -1;        /* Placement policy (set by -F), -1 if no -F */
+  int order = -1;         /* Free list order (FREE_ADDRESS with -A) */
+  int placements = 0;     /* Run every policy and order (set by -M) */
+  int benchmark = 0;      /* Time every trace many times (set by -k) */
+  stats_t matrix[NUM_FIT_POLICIES][NUM_FREE_ORDERS]; /* mm stats of -M */
 
   setbuf(stdout, 0);
   setbuf(stderr, 0);
@@ -243,10 +871,14 @@ int main(int argc, char **argv) {
    * Read and interpret the command line arguments
    */
   char c;
-  while ((c = getopt(argc, argv, "d:f:v:hVlD")) != EOF) {
+  while ((c = getopt(argc, argv,
+                     "c:d:f:k:F:G:H:L:t:v:w:hAVlDMPQ:R:Wxz")) != EOF) {
     switch (c) {
       case 'f': /* Use one specific trace file only (relative to curr dir) */
         tracefile = strdup(optarg);
+        if (num_traces == MAX_TRACES)
+          app_error("at most %d traces can be given", MAX_TRACES);
+        tracefiles[num_traces++] = tracefile;
         break;
 
       case 'l': /* Run libc malloc */
@@ -269,6 +901,99 @@ int main(int argc, char **argv) {
         debug_mode = DBG_EXPENSIVE;
         break;
 
+      case 'k': /* Benchmark mode: time every trace many times */
+        timed_runs = atoi(optarg);
+        if (timed_runs < 1)
+          app_error("-k needs a positive number of runs");
+        benchmark = 1;
+        break;
+
+      case 'w': /* Untimed runs before those */
+        warmup_runs = atoi(optarg);
+        if (warmup_runs < 0)
+          app_error("-w needs a number of runs");
+        break;
+
+      case 'c': { /* Pin to one CPU, so all runs see the same caches */
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(atoi(optarg), &cpus);
+        if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0)
+          unix_error("sched_setaffinity failed");
+        break;
+      }
+
+      case 'L': /* Time every request, list the slowest ones */
+        num_slowest = atoi(optarg);
+        if (num_slowest < 0)
+          app_error("-L needs the number of slowest requests to list");
+        break;
+
+      case 'H': /* Back the heap with huge pages */
+        hugepages = atoi(optarg);
+        if (hugepages < MEM_PAGES || hugepages > MEM_HUGETLB)
+          app_error("-H needs %d (normal), %d (transparent) or %d "
+                    "(MAP_HUGETLB) pages", MEM_PAGES, MEM_THP, MEM_HUGETLB);
+        mem_hugepages(hugepages);
+        break;
+
+      case 'P': /* Count hardware events in the timed runs */
+        use_perf = 1;
+        break;
+
+      case 'R': /* Slack for blocks that keep growing */
+        reserve = atoi(optarg);
+        break;
+
+      case 'G': /* Surplus of heap extensions */
+        grow = atoi(optarg);
+        if (grow < 0)
+          app_error("-G needs a percentage of the heap");
+        break;
+
+      case 'F': /* Placement policy */
+        policy = atoi(optarg);
+        if (policy < 0 || policy >= NUM_FIT_POLICIES)
+          app_error("-F needs %d (first), %d (next), %d (best) or %d (good) "
+                    "fit", FIT_FIRST, FIT_NEXT, FIT_BEST, FIT_GOOD);
+        break;
+
+      case 'A': /* Keep the free lists sorted by address */
+        order = FREE_ADDRESS;
+        break;
+
+      case 'M': /* Compare all the placement policies */
+        placements = 1;
+        break;
+
+      case 'Q': /* Defer coalescing of small blocks */
+        quick = atoi(optarg);
+        if (quick < 1)
+          app_error("-Q needs a positive number of blocks");
+        break;
+
+      case 'W': /* Compare the 4-byte and the 64-bit heap layouts */
+        layouts = 1;
+        break;
+
+      case 't': /* Replay on many threads at once */
+#ifdef THREADS
+        num_threads = atoi(optarg);
+        if (num_threads < 1)
+          app_error("-t needs a positive number of threads");
+        break;
+#else
+        app_error("-t needs the thread-safe build (make CPPFLAGS=-DTHREADS)\n");
+#endif
+
+      case 'z': /* Free with the size of the block */
+        sized_free = 1;
+        break;
+
+      case 'x': /* With -t, free every block on the next thread */
+        cross_free = 1;
+        break;
+
       case 'h': /* Print this message */
         usage();
         exit(EXIT_SUCCESS);
@@ -283,10 +1008,24 @@ int main(int argc, char **argv) {
     usage();
     exit(EXIT_FAILURE);
   }
+  /* One warm-up run with -k, unless -w said otherwise */
+  if (warmup_runs < 0)
+    warmup_runs = benchmark;
+  if (num_traces > 1 && num_threads == 0)
+    app_error("several traces can only be replayed with -t\n");
+  if (num_threads > 0 && run_libc)
+    app_error("-t can't be used with -l\n");
+  if (layouts && (num_threads > 0 || run_libc || quick > 0))
+    app_error("-W can't be used with -t, -l or -Q\n");
+  if (placements && (num_threads > 0 || run_libc || quick > 0 || layouts))
+    app_error("-M can't be used with -t, -l, -Q or -W\n");
 
   if (debug_mode != DBG_NONE)
     init_random_data();
 
+  if (use_perf)
+    perf_open();
+
   if (run_libc) {
     /*
      * Run and evaluate the libc malloc package
@@ -300,7 +1039,7 @@ int main(int argc, char **argv) {
     libc_stats.valid = eval_libc_valid(trace);
     if (libc_stats.valid) {
       speed_params.trace = trace;
-      libc_stats.secs = fsecs(eval_libc_speed, &speed_params);
+      time_runs(eval_libc_speed, &speed_params, &libc_stats);
     }
     free_trace(trace);
 
@@ -318,6 +1057,56 @@ int main(int argc, char **argv) {
    */
   if (verbose > 1)
     printf("\nTesting mm malloc\n");
+  if (reserve >= 0) {
+    mm_allocator.realloc_reserve(reserve);
+    mm64_allocator.realloc_reserve(reserve);
+  }
+  if (grow >= 0) {
+    mm_allocator.grow_percent(grow);
+    mm64_allocator.grow_percent(grow);
+  }
+  if (quick > 0)
+    mm->quick_limit(quick);
+  for (int i = 0; i < 2; i++) {
+    const mm_allocator_t *a = i ? &mm64_allocator : &mm_allocator;
+    a->fit_policy(policy);
+    a->free_order(order);
+  }
+
+  if (num_threads > 0) {
+    run_threads(tracefiles, num_traces, &mm_stats, ranges);
+    if (verbose && hugepages >= 0)
+      print_backing();
+    return mm_stats.valid ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  /* With -Q, the trace is run with eager coalescing first, for comparison */
+  if (quick > 0) {
+    mm->quick_limit(0);
+    run_tests(tracefile, &eager_stats, ranges, &speed_params);
+    mm->quick_limit(quick);
+  }
+
+  /* With -W, the trace is run with the 4-byte layout first, then 64-bit */
+  if (layouts) {
+    run_tests(tracefile, &compact_stats, ranges, &speed_params);
+    mm = &mm64_allocator;
+  }
+
+  /* With -M, the trace is run with every placement policy and order first */
+  if (placements) {
+    int old_policy = mm->fit_policy(-1);
+    int old_order = mm->free_order(-1);
+    for (int p = 0; p < NUM_FIT_POLICIES; p++) {
+      for (int o = 0; o < NUM_FREE_ORDERS; o++) {
+        mm->fit_policy(p);
+        mm->free_order(o);
+        run_tests(tracefile, &matrix[p][o], ranges, &speed_params);
+      }
+    }
+    mm->fit_policy(old_policy);
+    mm->free_order(old_order);
+  }
 
   /* Allocate the mm stats array, with one stats_t struct per tracefile */
   run_tests(tracefile, &mm_stats, ranges, &speed_params);
@@ -326,6 +1115,18 @@ int main(int argc, char **argv) {
   if (verbose) {
     printf("\nResults for mm malloc:\n");
     printresults(&mm_stats);
+    if (mm->realloc_reserve(-1) > 0)
+      printf("realloc reserve: %d%%\n", mm->realloc_reserve(-1));
+    if (mm->grow_percent(-1) > 0)
+      printf("heap growth: %d%%\n", mm->grow_percent(-1));
+    if (hugepages >= 0)
+      print_backing();
+    if (quick > 0)
+      print_coalescing(&eager_stats, &mm_stats);
+    if (layouts)
+      print_layouts(&compact_stats, &mm_stats);
+    if (placements)
+      print_placement(matrix);
   }
 
   return mm_stats.valid ? EXIT_SUCCESS : EXIT_FAILURE;
@@ -356,9 +1157,11 @@ static int add_range(range_t **ranges, char *lo, int size, const trace_t *trace,
     return 0;
   }
 
-  /* The payload must lie within the extent of the heap */
-  if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
-      (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
+  /* The payload must lie within the extent of the heap, of the reserved
+     area (the arenas of the thread-safe build) or of a mapping */
+  if (((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
+       (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) &&
+      !mem_in_reserve(lo, hi) && !mem_in_mapping(lo, hi)) {
     malloc_error(trace, opnum, "Payload (%p:%p) lies outside heap (%p:%p)", lo,
                  hi, mem_heap_lo(), mem_heap_hi());
     return 0;
@@ -372,11 +1175,13 @@ static int add_range(range_t **ranges, char *lo, int size, const trace_t *trace,
   /* The payload must not overlap any other payloads */
   range_t *p;
 
+  pthread_mutex_lock(&range_lock);
   for (p = *ranges; p != NULL; p = p->next) {
     if ((lo >= p->lo && lo <= p->hi) || (hi >= p->lo && hi <= p->hi)) {
       malloc_error(trace, opnum,
                    "Payload (%p:%p) overlaps another payload (%p:%p)\n", lo, hi,
                    p->lo, p->hi);
+      pthread_mutex_unlock(&range_lock);
       return 0;
     }
   }
@@ -392,6 +1197,7 @@ static int add_range(range_t **ranges, char *lo, int size, const trace_t *trace,
   p->hi = hi;
   p->index = index;
   *ranges = p;
+  pthread_mutex_unlock(&range_lock);
 
   return 1;
 }
@@ -402,6 +1208,7 @@ static int add_range(range_t **ranges, char *lo, int size, const trace_t *trace,
 static void remove_range(range_t **ranges, char *lo) {
   range_t **prevpp = ranges;
 
+  pthread_mutex_lock(&range_lock);
   for (range_t *p = *ranges; p != NULL; p = p->next) {
     if (p->lo == lo) {
       *prevpp = p->next;
@@ -410,6 +1217,7 @@ static void remove_range(range_t **ranges, char *lo) {
     }
     prevpp = &(p->next);
   }
+  pthread_mutex_unlock(&range_lock);
 }
 
 /*
@@ -452,6 +1260,18 @@ static void randomize_block(trace_t *traces, int index) {
     block[i] = random_data[(base + i) % RANDOM_DATA_LEN];
 }
 
+/* The block must have at least the bytes asked for, by mm_usable_size */
+static int check_usable(const trace_t *trace, int opnum, int index) {
+  size_t usable = mm->usable_size(trace->blocks[index]);
+  if (usable < trace->block_sizes[index]) {
+    malloc_error(trace, opnum, "mm_usable_size of block %d (%p) is %zu, "
+                 "less than the %zu bytes asked for", index,
+                 trace->blocks[index], usable, trace->block_sizes[index]);
+    return 0;
+  }
+  return 1;
+}
+
 static void check_index(const trace_t *trace, int opnum, int index) {
   if (index < 0)
     return; /* we're doing free(NULL) */
@@ -485,58 +1305,67 @@ static void check_index(const trace_t *trace, int opnum, int index) {
  *********************************************/
 
 /*
- * read_trace - read a trace file and store it in memory
+ * map_trace - use a binary trace in place. The records are not copied, only
+ *             scanned once, so that a bad index cannot crash the replay.
  */
-static trace_t *read_trace(stats_t *stats, const char *filename) {
-  FILE *tracefile;
-  trace_t *trace;
-
-  if (verbose > 1)
-    printf("Reading tracefile: %s\n", filename);
-
-  /* Allocate the trace record */
-  if (!(trace = (trace_t *)malloc(sizeof(trace_t))))
-    unix_error("malloc 1 failed in read_trace");
+static void map_trace(trace_t *trace, int fd) {
+  struct stat st;
+  if (fstat(fd, &st) < 0)
+    unix_error("Could not stat %s in read_trace", trace->filename);
+
+  trace->map_len = st.st_size;
+  trace->map = mmap(NULL, trace->map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (trace->map == MAP_FAILED)
+    unix_error("Could not map %s in read_trace", trace->filename);
+
+  const tracehdr_t *hdr = trace->map;
+  if (trace->map_len < sizeof(*hdr))
+    app_error("%s: binary trace is truncated", trace->filename);
+  if (hdr->version != TRACE_VERSION)
+    app_error("%s: unsupported binary trace version %u", trace->filename,
+              hdr->version);
+  if (trace->map_len != sizeof(*hdr) + hdr->num_ops * sizeof(traceop_t))
+    app_error("%s: binary trace is truncated", trace->filename);
+
+  trace->weight = hdr->weight;
+  trace->num_ids = hdr->num_ids;
+  trace->num_ops = hdr->num_ops;
+  trace->ignore_ranges = hdr->ignore_ranges;
+  trace->ops = (traceop_t *)(hdr + 1);
 
-  /* Read the trace file header */
-  strcpy(trace->filename, filename);
-  if (!(tracefile = fopen(trace->filename, "r")))
-    unix_error("Could not open %s in read_trace", trace->filename);
+  for (int i = 0; i < trace->num_ops; i++) {
+    const traceop_t *op = &trace->ops[i];
+    if (op->type >= NUM_TYPES || op->index >= trace->num_ids ||
+        (op->index < 0 && op->type != FREE) ||
+        (op->type == MEMALIGN && op->align >= 8 * sizeof(int)) ||
+        ((op->type == ALLOC_BATCH || op->type == FREE_BATCH) &&
+         (op->count == 0 || op->count > trace->num_ids - op->index)))
+      app_error("%s: bad request %d in binary trace", trace->filename, i);
+  }
+}
 
+/*
+ * parse_trace - read the requests of a text trace into a new ops array
+ */
+static void parse_trace(trace_t *trace, FILE *tracefile) {
   int ignore = 0;
   ignore += fscanf(tracefile, "%d", &trace->weight);
   ignore += fscanf(tracefile, "%d", &trace->num_ids);
   ignore += fscanf(tracefile, "%d", &trace->num_ops);
   ignore += fscanf(tracefile, "%d", &trace->ignore_ranges);
 
-  if (trace->weight < 0 || trace->weight > 3)
-    app_error("%s: weight can only be in {0, 1, 2, 3}", trace->filename);
-  if (trace->ignore_ranges != 0 && trace->ignore_ranges != 1)
-    app_error("%s: ignore-ranges can only be zero or one", trace->filename);
-
   /* We'll store each request line in the trace in this array */
   if (!(trace->ops = (traceop_t *)malloc(trace->num_ops * sizeof(traceop_t))))
     unix_error("malloc 2 failed in read_trace");
 
-  /* We'll keep an array of pointers to the allocated blocks here... */
-  if (!(trace->blocks = (char **)calloc(trace->num_ids, sizeof(char *))))
-    unix_error("malloc 3 failed in read_trace");
-
-  /* ... along with the corresponding byte sizes of each block */
-  if (!(trace->block_sizes = (size_t *)calloc(trace->num_ids, sizeof(size_t))))
-    unix_error("malloc 4 failed in read_trace");
-
-  /* and, if we're debugging, the offset into the random data */
-  if (!(trace->block_rand_base =
-          calloc(trace->num_ids, sizeof(*trace->block_rand_base))))
-    unix_error("malloc 5 failed in read_trace");
-
   /* read every request line in the trace file */
   int index = 0;
   int op_index = 0;
   int max_index = 0;
   char type[MAXLINE];
   int size;
+  unsigned align;
+  unsigned count;
 
   while (fscanf(tracefile, "%s", type) != EOF) {
     switch (type[0]) {
@@ -556,10 +1385,41 @@ static trace_t *read_trace(stats_t *stats, const char *filename) {
         max_index = (index > max_index) ? index : max_index;
         break;
 
+      case 'm':
+        ignore += fscanf(tracefile, "%u %u %u", &index, &align, &size);
+        if (align == 0 || (align & (align - 1)) != 0)
+          app_error("Bad alignment (%u) in tracefile %s\n", align,
+                    trace->filename);
+        trace->ops[op_index].type = MEMALIGN;
+        trace->ops[op_index].align = __builtin_ctz(align);
+        trace->ops[op_index].index = index;
+        trace->ops[op_index].size = size;
+        max_index = (index > max_index) ? index : max_index;
+        break;
+
       case 'f':
         ignore += fscanf(tracefile, "%ud", &index);
         trace->ops[op_index].type = FREE;
         trace->ops[op_index].index = index;
+        trace->ops[op_index].size = 0;
+        break;
+
+      case 'A':
+      case 'F':
+        ignore += fscanf(tracefile, "%u %u", &index, &count);
+        if (type[0] == 'A')
+          ignore += fscanf(tracefile, "%u", &size);
+        else
+          size = 0;
+        if (count == 0 || count > UINT16_MAX)
+          app_error("Bad batch length (%u) in tracefile %s\n", count,
+                    trace->filename);
+        trace->ops[op_index].type = type[0] == 'A' ? ALLOC_BATCH : FREE_BATCH;
+        trace->ops[op_index].count = count;
+        trace->ops[op_index].index = index;
+        trace->ops[op_index].size = size;
+        if (index + (int)count - 1 > max_index)
+          max_index = index + count - 1;
         break;
 
       default:
@@ -571,9 +1431,58 @@ static trace_t *read_trace(stats_t *stats, const char *filename) {
       break;
   }
 
-  fclose(tracefile);
   assert(max_index == trace->num_ids - 1);
   assert(trace->num_ops == op_index);
+}
+
+/*
+ * read_trace - read a trace file and store it in memory. Text traces are
+ *              parsed, binary ones (starting with TRACE_MAGIC) are mapped.
+ */
+static trace_t *read_trace(stats_t *stats, const char *filename) {
+  FILE *tracefile;
+  trace_t *trace;
+
+  if (verbose > 1)
+    printf("Reading tracefile: %s\n", filename);
+
+  /* Allocate the trace record */
+  if (!(trace = (trace_t *)malloc(sizeof(trace_t))))
+    unix_error("malloc 1 failed in read_trace");
+
+  /* Read the trace file header */
+  strcpy(trace->filename, filename);
+  if (!(tracefile = fopen(trace->filename, "r")))
+    unix_error("Could not open %s in read_trace", trace->filename);
+
+  char magic[sizeof(TRACE_MAGIC)];
+  trace->map = NULL;
+  if (fread(magic, sizeof(magic), 1, tracefile) == 1 &&
+      memcmp(magic, TRACE_MAGIC, sizeof(magic)) == 0) {
+    map_trace(trace, fileno(tracefile));
+  } else {
+    rewind(tracefile);
+    parse_trace(trace, tracefile);
+  }
+  fclose(tracefile);
+
+  if (trace->weight < 0 || trace->weight > 3)
+    app_error("%s: weight can only be in {0, 1, 2, 3}", trace->filename);
+  if (trace->ignore_ranges != 0 && trace->ignore_ranges != 1)
+    app_error("%s: ignore-ranges can only be zero or one", trace->filename);
+
+  /* We'll keep an array of pointers to the allocated blocks here... */
+  if (!(trace->blocks = (char **)calloc(trace->num_ids, sizeof(char *))))
+    unix_error("malloc 3 failed in read_trace");
+
+  /* ... along with the corresponding byte sizes of each block */
+  if (!(trace->block_sizes = (size_t *)calloc(trace->num_ids, sizeof(size_t))))
+    unix_error("malloc 4 failed in read_trace");
+
+  /* and, if we're debugging, the offset into the random data */
+  if (!(trace->block_rand_base =
+          calloc(trace->num_ids, sizeof(*trace->block_rand_base))))
+    unix_error("malloc 5 failed in read_trace");
 
   /* fill in the stats */
   strcpy(stats->filename, trace->filename);
@@ -597,7 +1506,10 @@ static void reinit_trace(trace_t *trace) {
  *              to, all of which were allocated in read_trace().
  */
 static void free_trace(trace_t *trace) {
-  free(trace->ops); /* free the three arrays... */
+  if (trace->map) /* free the three arrays... */
+    munmap(trace->map, trace->map_len);
+  else
+    free(trace->ops);
   free(trace->blocks);
   free(trace->block_sizes);
   free(trace->block_rand_base);
@@ -619,22 +1531,36 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges) {
   reinit_trace(trace);
 
   /* Call the mm package's init function */
-  if (mm_init() < 0) {
+  if (mm->init() < 0) {
     malloc_error(trace, 0, "mm_init failed.");
     return 0;
   }
 
+  return valid_requests(trace, ranges, NULL);
+}
+
+/*
+ * valid_requests - Run and check the requests of a trace. With w, this is
+ *     one of several threads, and blocks may be freed by the next one.
+ */
+static int valid_requests(trace_t *trace, range_t **ranges, worker_t *w) {
   /* Interpret each operation in the trace in order */
   for (int i = 0; i < trace->num_ops; i++) {
     int index = trace->ops[i].index;
     size_t size = trace->ops[i].size;
+    int count;
     char *newp;
     char *oldp;
     char *p;
 
-    if (debug_mode == DBG_EXPENSIVE) {
+    if (w) {
+      if (atomic_load_explicit(&replay_failed, memory_order_relaxed))
+        return 0;
+      if (cross_free)
+        drain_frees(w);
+    } else if (debug_mode == DBG_EXPENSIVE) {
       /* Let the students check their own heap */
-      mm_checkheap(verbose);
+      mm->checkheap(verbose);
 
       /* Now check that all our allocated blocks have the right data */
       range_t *r = *ranges;
@@ -646,10 +1572,24 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges) {
 
     switch (trace->ops[i].type) {
       case ALLOC: /* mm_malloc */
+      case MEMALIGN: /* mm_memalign */
         /* Call the student's malloc */
-        if ((p = mm_malloc(size)) == NULL) {
-          malloc_error(trace, i, "mm_malloc failed.");
-          return 0;
+        if (trace->ops[i].type == ALLOC) {
+          if ((p = mm->malloc(size)) == NULL) {
+            malloc_error(trace, i, "mm_malloc failed.");
+            return 0;
+          }
+        } else {
+          size_t align = (size_t)1 << trace->ops[i].align;
+          if ((p = mm->memalign(align, size)) == NULL) {
+            malloc_error(trace, i, "mm_memalign failed.");
+            return 0;
+          }
+          if ((uintptr_t)p & (align - 1)) {
+            malloc_error(trace, i, "mm_memalign payload not aligned to %zu",
+                         align);
+            return 0;
+          }
         }
 
         /*
@@ -663,6 +1603,8 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges) {
         /* Remember region */
         trace->blocks[index] = p;
         trace->block_sizes[index] = size;
+        if (check_usable(trace, i, index) == 0)
+          return 0;
 
         /* Set to random data, for debugging. */
         randomize_block(trace, index);
@@ -671,10 +1613,18 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges) {
       case REALLOC: /* mm_realloc */
         check_index(trace, i, index);
 
-        /* Call the student's realloc */
+        /* Remove the old region from the range list before the call, since
+         * with -t another thread may get the old block as soon as realloc
+         * has freed it */
         oldp = trace->blocks[index];
-        newp = mm_realloc(oldp, size);
+        remove_range(ranges, oldp);
+
+        /* Call the student's realloc */
+        newp = mm->realloc(oldp, size);
         if ((newp == NULL) && (size != 0)) {
+          /* The old block is still there */
+          if (trace->block_sizes[index] > 0)
+            add_range(ranges, oldp, trace->block_sizes[index], trace, i, index);
           malloc_error(trace, i, "mm_realloc failed.");
           return 0;
         }
@@ -683,9 +1633,6 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges) {
           return 0;
         }
 
-        /* Remove the old region from the range list */
-        remove_range(ranges, oldp);
-
         /* Check new block for correctness and add it to range list */
         if (size > 0 && add_range(ranges, newp, size, trace, i, index) == 0)
           return 0;
@@ -697,6 +1644,8 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges) {
           trace->block_sizes[index] = size;
         check_index(trace, i, index);
         trace->block_sizes[index] = size;
+        if (size > 0 && check_usable(trace, i, index) == 0)
+          return 0;
 
         /* Set to random data, for debugging. */
         randomize_block(trace, index);
@@ -712,7 +1661,42 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges) {
           p = trace->blocks[index];
           remove_range(ranges, p);
         }
-        mm_free(p);
+        if (w && cross_free && p)
+          hand_over(w, p);
+        else if (sized_free && p)
+          mm->free_sized(p, trace->block_sizes[index]);
+        else
+          mm->free(p);
+        break;
+
+      case ALLOC_BATCH: /* mm_malloc_batch */
+        count = trace->ops[i].count;
+        if (mm->malloc_batch(size, count, (void **)&trace->blocks[index]) !=
+            count) {
+          malloc_error(trace, i, "mm_malloc_batch failed.");
+          return 0;
+        }
+        for (int id = index; id < index + count; id++) {
+          if (add_range(ranges, trace->blocks[id], size, trace, i, id) == 0)
+            return 0;
+          trace->block_sizes[id] = size;
+          if (check_usable(trace, i, id) == 0)
+            return 0;
+          randomize_block(trace, id);
+        }
+        break;
+
+      case FREE_BATCH: /* mm_free_batch */
+        count = trace->ops[i].count;
+        for (int id = index; id < index + count; id++) {
+          check_index(trace, i, id);
+          remove_range(ranges, trace->blocks[id]);
+          if (w && cross_free)
+            hand_over(w, trace->blocks[id]);
+        }
+        /* This sorts the pointers of the dead blocks, which is harmless */
+        if (!(w && cross_free))
+          mm->free_batch((void **)&trace->blocks[index], count);
         break;
 
       default:
@@ -729,34 +1713,39 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges) {
  *   The idea is to remember the high water mark "hwm" of the heap for
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
  *   Utilization is the ratio hwm/heapsize, where heapsize is the
- *   size of the heap in bytes after running the student's malloc
- *   package on the trace. Note that our implementation of mem_sbrk()
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap.
+ *   peak size of the heap in bytes while running the student's malloc
+ *   package on the trace. mem_sbrk() allows the brk pointer to be
+ *   decremented, so the heap size at the end may be smaller than that.
  *
  *   A higher number is better: 1 is optimal.
  */
-static double eval_mm_util(trace_t *trace, int *used_p, int *total_p) {
-  int max_total_size = 0;
-  int total_size = 0;
+static double eval_mm_util(trace_t *trace, size_t *used_p,
+                           size_t *total_p) {
+  size_t max_total_size = 0;
+  size_t total_size = 0;
 
   reinit_trace(trace);
 
   /* initialize the heap and the mm malloc package */
   mem_reset_brk();
-  if (mm_init() < 0)
+  if (mm->init() < 0)
     app_error("trace: mm_init failed in eval_mm_util");
 
   for (int i = 0; i < trace->num_ops; i++) {
-    int index, size, newsize, oldsize;
+    int index, size, newsize, oldsize, count;
     char *p, *newp, *oldp;
 
     switch (trace->ops[i].type) {
       case ALLOC: /* mm_alloc */
+      case MEMALIGN: /* mm_memalign */
         index = trace->ops[i].index;
         size = trace->ops[i].size;
 
-        if ((p = mm_malloc(size)) == NULL)
+        if (trace->ops[i].type == ALLOC)
+          p = mm->malloc(size);
+        else
+          p = mm->memalign((size_t)1 << trace->ops[i].align, size);
+        if (p == NULL)
           app_error("trace: mm_malloc failed in eval_mm_util");
 
         /* Remember region and size */
@@ -772,7 +1761,7 @@ static double eval_mm_util(trace_t *trace, int *used_p, int *total_p) {
         oldsize = trace->block_sizes[index];
 
         oldp = trace->blocks[index];
-        if ((newp = mm_realloc(oldp, newsize)) == NULL && newsize != 0)
+        if ((newp = mm->realloc(oldp, newsize)) == NULL && newsize != 0)
           app_error("trace: mm_realloc failed in eval_mm_util");
 
         /* Remember region and size */
@@ -792,11 +1781,36 @@ static double eval_mm_util(trace_t *trace, int *used_p, int *total_p) {
           p = trace->blocks[index];
         }
 
-        mm_free(p);
+        if (sized_free && p)
+          mm->free_sized(p, size);
+        else
+          mm->free(p);
 
         total_size -= size;
         break;
 
+      case ALLOC_BATCH: /* mm_malloc_batch */
+        index = trace->ops[i].index;
+        size = trace->ops[i].size;
+        count = trace->ops[i].count;
+        if (mm->malloc_batch(size, count, (void **)&trace->blocks[index]) !=
+            count)
+          app_error("trace: mm_malloc_batch failed in eval_mm_util");
+        for (int id = index; id < index + count; id++)
+          trace->block_sizes[id] = size;
+
+        total_size += count * size;
+        break;
+
+      case FREE_BATCH: /* mm_free_batch */
+        index = trace->ops[i].index;
+        count = trace->ops[i].count;
+        for (int id = index; id < index + count; id++)
+          total_size -= trace->block_sizes[id];
+
+        mm->free_batch((void **)&trace->blocks[index], count);
+        break;
+
       default:
         app_error("trace: Nonexistent request type in eval_mm_util");
     }
@@ -807,9 +1821,9 @@ static double eval_mm_util(trace_t *trace, int *used_p, int *total_p) {
   }
 
   *used_p = max_total_size;
-  *total_p = mem_heapsize();
+  *total_p = mem_peak_heapsize();
 
-  return ((double)max_total_size / (double)mem_heapsize());
+  return ((double)max_total_size / (double)mem_peak_heapsize());
 }
 
 /*
@@ -822,30 +1836,59 @@ static void eval_mm_speed(void *ptr) {
 
   /* Reset the heap and initialize the mm package */
   mem_reset_brk();
-  if (mm_init() < 0)
+  if (mm->init() < 0)
     app_error("mm_init failed in eval_mm_speed");
 
+  speed_requests(trace, ((speed_t *)ptr)->latency, NULL);
+}
+
+/*
+ * speed_requests - Run the requests of a trace, timing each if lat is set.
+ *     With w, this is one of several threads (see valid_requests).
+ */
+static void speed_requests(trace_t *trace, latency_t *lat, worker_t *w) {
+  uint64_t start = 0;
+
   /* Interpret each trace request */
   for (int i = 0; i < trace->num_ops; i++) {
-    int index, size, newsize;
+    int index, size, newsize, count;
     char *p, *newp, *oldp, *block;
 
+    if (w && cross_free)
+      drain_frees(w);
+    if (lat)
+      start = now_ns();
+
     switch (trace->ops[i].type) {
       case ALLOC: /* mm_malloc */
         index = trace->ops[i].index;
         size = trace->ops[i].size;
-        if ((p = mm_malloc(size)) == NULL)
+        if ((p = mm->malloc(size)) == NULL)
           app_error("mm_malloc error in eval_mm_speed");
         trace->blocks[index] = p;
+        if (sized_free)
+          trace->block_sizes[index] = size;
+        break;
+
+      case MEMALIGN: /* mm_memalign */
+        index = trace->ops[i].index;
+        size = trace->ops[i].size;
+        if ((p = mm->memalign((size_t)1 << trace->ops[i].align, size)) == NULL)
+          app_error("mm_memalign error in eval_mm_speed");
+        trace->blocks[index] = p;
+        if (sized_free)
+          trace->block_sizes[index] = size;
         break;
 
       case REALLOC: /* mm_realloc */
         index = trace->ops[i].index;
         newsize = trace->ops[i].size;
         oldp = trace->blocks[index];
-        if ((newp = mm_realloc(oldp, newsize)) == NULL && newsize != 0)
+        if ((newp = mm->realloc(oldp, newsize)) == NULL && newsize != 0)
           app_error("mm_realloc error in eval_mm_speed");
         trace->blocks[index] = newp;
+        if (sized_free)
+          trace->block_sizes[index] = newsize;
         break;
 
       case FREE: /* mm_free */
@@ -855,12 +1898,42 @@ static void eval_mm_speed(void *ptr) {
         } else {
           block = trace->blocks[index];
         }
-        mm_free(block);
+        if (w && cross_free && block)
+          hand_over(w, block);
+        else if (sized_free && block)
+          mm->free_sized(block, trace->block_sizes[index]);
+        else
+          mm->free(block);
+        break;
+
+      case ALLOC_BATCH: /* mm_malloc_batch */
+        index = trace->ops[i].index;
+        count = trace->ops[i].count;
+        if (mm->malloc_batch(trace->ops[i].size, count,
+                            (void **)&trace->blocks[index]) != count)
+          app_error("mm_malloc_batch error in eval_mm_speed");
+        if (sized_free)
+          for (int id = index; id < index + count; id++)
+            trace->block_sizes[id] = trace->ops[i].size;
+        break;
+
+      case FREE_BATCH: /* mm_free_batch */
+        index = trace->ops[i].index;
+        count = trace->ops[i].count;
+        if (w && cross_free) {
+          for (int id = index; id < index + count; id++)
+            hand_over(w, trace->blocks[id]);
+        } else {
+          mm->free_batch((void **)&trace->blocks[index], count);
+        }
         break;
 
       default:
         app_error("Nonexistent request type in eval_mm_speed");
     }
+
+    if (lat)
+      lat_record(lat, i, trace->ops[i].type, now_ns() - start);
   }
 }
 
@@ -886,6 +1959,15 @@ static int eval_libc_valid(trace_t *trace) {
         trace->blocks[trace->ops[i].index] = p;
         break;
 
+      case MEMALIGN: /* aligned_alloc */
+        if ((p = aligned_alloc((size_t)1 << trace->ops[i].align,
+                               trace->ops[i].size)) == NULL) {
+          malloc_error(trace, i, "libc aligned_alloc failed");
+          unix_error("System message");
+        }
+        trace->blocks[trace->ops[i].index] = p;
+        break;
+
       case REALLOC: /* realloc */
         newsize = trace->ops[i].size;
         oldp = trace->blocks[trace->ops[i].index];
@@ -904,6 +1986,23 @@ static int eval_libc_valid(trace_t *trace) {
         }
         break;
 
+      case ALLOC_BATCH: /* malloc, one by one */
+        for (int id = trace->ops[i].index;
+             id < trace->ops[i].index + trace->ops[i].count; id++) {
+          if ((p = malloc(trace->ops[i].size)) == NULL) {
+            malloc_error(trace, i, "libc malloc failed");
+            unix_error("System message");
+          }
+          trace->blocks[id] = p;
+        }
+        break;
+
+      case FREE_BATCH: /* free, one by one */
+        for (int id = trace->ops[i].index;
+             id < trace->ops[i].index + trace->ops[i].count; id++)
+          free(trace->blocks[id]);
+        break;
+
       default:
         app_error("invalid operation type  in eval_libc_valid");
     }
@@ -935,6 +2034,15 @@ static void eval_libc_speed(void *ptr) {
         trace->blocks[index] = p;
         break;
 
+      case MEMALIGN: /* aligned_alloc */
+        index = trace->ops[i].index;
+        size = trace->ops[i].size;
+        if ((p = aligned_alloc((size_t)1 << trace->ops[i].align, size)) ==
+            NULL)
+          unix_error("aligned_alloc failed in eval_libc_speed");
+        trace->blocks[index] = p;
+        break;
+
       case REALLOC: /* realloc */
         index = trace->ops[i].index;
         newsize = trace->ops[i].size;
@@ -954,6 +2062,20 @@ static void eval_libc_speed(void *ptr) {
           free(0);
         }
         break;
+
+      case ALLOC_BATCH: /* malloc, one by one */
+        index = trace->ops[i].index;
+        size = trace->ops[i].size;
+        for (int id = index; id < index + trace->ops[i].count; id++)
+          if ((trace->blocks[id] = malloc(size)) == NULL)
+            unix_error("malloc failed in eval_libc_speed");
+        break;
+
+      case FREE_BATCH: /* free, one by one */
+        index = trace->ops[i].index;
+        for (int id = index; id < index + trace->ops[i].count; id++)
+          free(trace->blocks[id]);
+        break;
     }
   }
 }
@@ -1000,7 +2122,8 @@ static void printresults(stats_t *stats) {
 
   /* print '--' if util isn't weighted */
   if (stats->weight == WNONE || stats->weight == WALL || stats->weight == WUTIL)
-    printf(" %5.1f%% %8d %8d", stats->util * 100.0, stats->used, stats->total);
+    printf(" %5.1f%% %8zu %8zu", stats->util * 100.0, stats->used,
+           stats->total);
   else
     printf(" %6s %8s %8s", "--", "--", "--");
 
@@ -1012,6 +2135,31 @@ static void printresults(stats_t *stats) {
     printf("%8s%10s%7s", "--", "--", "--");
 
   printf(" %s\n", stats->filename);
+
+  if (stats->perf_valid) {
+    printf("per request:");
+    for (int i = 0; i < NUM_COUNTERS; i++) {
+      if (stats->perf[i] < 0)
+        printf(" %s n/a", counters[i].name);
+      else
+        printf(" %s %.2f", counters[i].name, stats->perf[i]);
+    }
+    printf("\n");
+  }
+
+#ifdef STATS
+  if (stats->weight != WPERF)
+    print_alloc_stats(&stats->alloc);
+#endif
+
+  if (stats->latency)
+    print_latency(stats->latency);
+
+  if (stats->runs > 1)
+    printf("timing: %d runs, min %.3f median %.3f stddev %.3f usecs, "
+           "%.0f ops/sec (median)\n",
+           stats->runs, stats->secs * 1e6, stats->secs_median * 1e6,
+           stats->secs_stddev * 1e6, stats->ops / stats->secs_median);
 }
 
 /*
@@ -1054,7 +2202,9 @@ static void malloc_error(const trace_t *trace, int opnum, const char *fmt,
  * usage - Explain the command line arguments
  */
 static void usage(void) {
-  fprintf(stderr, "Usage: mdriver [-hlVD] [-d <i>] [-v <i>] [-f <file>]\n");
+  fprintf(stderr, "Usage: mdriver [-hlVDPAMWxz] [-d <i>] [-v <i>] [-k <i>] "
+                  "[-w <i>] [-c <i>] [-H <i>] [-L <i>] [-Q <i>] [-R <i>] "
+                  "[-G <i>] [-F <i>] [-t <i>] [-f <file>]...\n");
   fprintf(stderr, "Options\n");
   fprintf(stderr, "\t-d <i>     Debug: 0 off; 1 default; 2 lots.\n");
   fprintf(stderr, "\t-D         Equivalent to -d2.\n");
@@ -1063,4 +2213,203 @@ static void usage(void) {
   fprintf(stderr, "\t-V         Print diagnostics as each trace is run.\n");
   fprintf(stderr, "\t-v <i>     Set Verbosity Level to <i>\n");
   fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
+  fprintf(stderr, "\t-k <i>     Time each trace <i> times, report "
+                  "min/median.\n");
+  fprintf(stderr, "\t-w <i>     Run each trace <i> times before timing "
+                  "(1 with -k).\n");
+  fprintf(stderr, "\t-c <i>     Pin the driver to CPU <i>.\n");
+  fprintf(stderr, "\t-H <i>     Back the heap with huge pages: %d transparent, "
+                  "%d MAP_HUGETLB.\n", MEM_THP, MEM_HUGETLB);
+  fprintf(stderr, "\t-P         Count hardware events (cycles, cache and "
+                  "TLB misses...) per request.\n");
+  fprintf(stderr, "\t-L <i>     Print latency percentiles of every request "
+                  "type and the <i> slowest requests.\n");
+  fprintf(stderr, "\t-Q <i>     Coalesce small blocks only once <i> of a size "
+                  "are freed, compare with eager coalescing.\n");
+  fprintf(stderr, "\t-R <i>     Give blocks that keep growing <i>%% slack.\n");
+  fprintf(stderr, "\t-G <i>     Grow the heap by up to <i>%% more than a "
+                  "miss needs.\n");
+  fprintf(stderr, "\t-F <i>     Place blocks by %d first, %d next, %d best or "
+                  "%d good fit.\n", FIT_FIRST, FIT_NEXT, FIT_BEST, FIT_GOOD);
+  fprintf(stderr, "\t-A         Keep the free lists sorted by address.\n");
+  fprintf(stderr, "\t-M         Compare all placement policies and free "
+                  "list orders.\n");
+  fprintf(stderr, "\t-W         Compare the 4-byte and the 64-bit heap "
+                  "layouts.\n");
+  fprintf(stderr, "\t-t <i>     Replay the traces, or shards of one trace, "
+                  "on <i> threads at once.\n");
+  fprintf(stderr, "\t-x         With -t, free every block on another "
+                  "thread.\n");
+  fprintf(stderr, "\t-z         Free blocks with mm_free_sized.\n");
+}
+
+#ifdef STATS
+/*
+ * read_alloc_stats - Get the counters of the allocator (mm_stats is
+ *     shadowed by the variables of that name elsewhere)
+ */
+static void read_alloc_stats(mm_stats_t *alloc) {
+  mm->stats(alloc);
+}
+
+/*
+ * print_alloc_stats - Print the counters of the allocator, and the requests
+ *     and free bytes of every bucket that has any
+ */
+static void print_alloc_stats(mm_stats_t *alloc) {
+  printf("find_fit: %lu calls, %.1f probes on average, %lu at most\n",
+         alloc->fits, alloc->fits ? (double)alloc->probes / alloc->fits : 0.0,
+         alloc->max_probes);
+  printf("splits: %lu, coalesce prev/next/both: %lu/%lu/%lu\n", alloc->splits,
+         alloc->coalesce_prev, alloc->coalesce_next, alloc->coalesce_both);
+  printf("extend_heap: %lu calls, %lu bytes\n", alloc->extends,
+         alloc->extend_bytes);
+  printf("realloc in place/moved/copied: %lu/%lu/%lu\n",
+         alloc->realloc_inplace, alloc->realloc_moved, alloc->realloc_copied);
+  if (alloc->quick_hits || alloc->quick_flushes)
+    printf("quick lists: %lu hits, coalesced %lu times\n", alloc->quick_hits,
+           alloc->quick_flushes);
+  printf("%8s%10s%12s\n", "bucket", "mallocs", "free bytes");
+  for (int i = 0; i < alloc->num_buckets; i++)
+    if (alloc->mallocs[i] || alloc->free_bytes[i])
+      printf("%8d%10lu%12lu\n", i, alloc->mallocs[i], alloc->free_bytes[i]);
+}
+#endif
+
+/*
+ * print_coalescing - Compare the results with the quick lists of -Q to those
+ *     of eager coalescing on the same trace
+ */
+static void print_coalescing(stats_t *eager, stats_t *deferred) {
+  if (!eager->valid || !deferred->valid)
+    return;
+
+  double eager_kops = eager->ops / 1e3 / eager->secs;
+  double deferred_kops = deferred->ops / 1e3 / deferred->secs;
+  char label[32];
+  snprintf(label, sizeof(label), "deferred (%d)", mm->quick_limit(-1));
+  printf("coalescing %16s%8s\n", "util", "Kops");
+  printf("  %-16s %6.1f%%%8.0f\n", "eager", eager->util * 100.0, eager_kops);
+  printf("  %-16s %6.1f%%%8.0f\n", label, deferred->util * 100.0,
+         deferred_kops);
+  printf("  %-16s %+6.1f%%%+7.1f%%\n", "change",
+         (deferred->util - eager->util) * 100.0,
+         (deferred_kops / eager_kops - 1) * 100.0);
+}
+
+/*
+ * print_layouts - Compare the results of the 64-bit heap layout of -W to
+ *     those of the 4-byte one on the same trace
+ */
+static void print_layouts(stats_t *compact, stats_t *wide) {
+  if (!compact->valid || !wide->valid)
+    return;
+
+  double compact_kops = compact->ops / 1e3 / compact->secs;
+  double wide_kops = wide->ops / 1e3 / wide->secs;
+  printf("layout %20s%12s%8s\n", "util", "peak KB", "Kops");
+  printf("  %-16s %6.1f%%%12.0f%8.0f\n", mm_allocator.layout,
+         compact->util * 100.0, compact->total / 1024.0, compact_kops);
+  printf("  %-16s %6.1f%%%12.0f%8.0f\n", mm64_allocator.layout,
+         wide->util * 100.0, wide->total / 1024.0, wide_kops);
+  printf("  %-16s %+6.1f%%%+11.1f%%%+7.1f%%\n", "change",
+         (wide->util - compact->util) * 100.0,
+         ((double)wide->total / compact->total - 1) * 100.0,
+         (wide_kops / compact_kops - 1) * 100.0);
+}
+
+/*
+ * print_placement - Print the results of every placement policy and free list
+ *     order of -M, and mark the best utilization and throughput (as printed)
+ */
+static void print_placement(stats_t m[NUM_FIT_POLICIES][NUM_FREE_ORDERS]) {
+  static const char *policies[] = {[FIT_FIRST] = "first", [FIT_NEXT] = "next",
+                                   [FIT_BEST] = "best", [FIT_GOOD] = "good"};
+  static const char *orders[] = {[FREE_LIFO] = "lifo",
+                                 [FREE_ADDRESS] = "address"};
+  double best_util = 0, best_kops = 0;
+
+  for (int p = 0; p < NUM_FIT_POLICIES; p++) {
+    for (int o = 0; o < NUM_FREE_ORDERS; o++) {
+      stats_t *stats = &m[p][o];
+      if (!stats->valid)
+        continue;
+      double util = round(stats->util * 1000);
+      double kops = round(stats->ops / 1e3 / stats->secs);
+      best_util = util > best_util ? util : best_util;
+      best_kops = kops > best_kops ? kops : best_kops;
+    }
+  }
+
+  printf("placement %17s%8s\n", "util", "Kops");
+  for (int p = 0; p < NUM_FIT_POLICIES; p++) {
+    for (int o = 0; o < NUM_FREE_ORDERS; o++) {
+      stats_t *stats = &m[p][o];
+      char label[32];
+      snprintf(label, sizeof(label), "%s, %s", policies[p], orders[o]);
+      if (!stats->valid) {
+        printf("  %-16s %7s%8s\n", label, "-", "-");
+        continue;
+      }
+      double util = round(stats->util * 1000);
+      double kops = round(stats->ops / 1e3 / stats->secs);
+      printf("  %-16s %6.1f%%%c%7.0f%c\n", label, util / 10,
+             util == best_util ? '*' : ' ', kops,
+             kops == best_kops ? '*' : ' ');
+    }
+  }
+}
+
+/*
+ * print_backing - Print the pages the heap of the last run got, which are
+ *     normal ones if the huge pages of -H were not available
+ */
+static void print_backing(void) {
+  if (mem_heap_pagesize() > mem_pagesize())
+    printf("heap pages: MAP_HUGETLB, %zu KB\n", mem_heap_pagesize() / 1024);
+  else if (mem_hugepagesize() > 0)
+    printf("heap pages: transparent, %zu KB\n", mem_hugepagesize() / 1024);
+  else
+    printf("heap pages: normal, %zu KB\n", mem_pagesize() / 1024);
+}
+
+/*
+ * print_latency - Print the latency percentiles of every request type and
+ *     the slowest requests, with the trace lines they come from
+ */
+static void print_latency(latency_t *lat) {
+  static const char *names[] = {[ALLOC] = "malloc", [FREE] = "free",
+                                [REALLOC] = "realloc",
+                                [MEMALIGN] = "memalign",
+                                [ALLOC_BATCH] = "malloc[n]",
+                                [FREE_BATCH] = "free[n]"};
+
+  printf("latency (ns) %10s%8s%8s%8s%8s%10s\n", "count", "p50", "p90", "p99",
+         "p99.9", "max");
+  for (int type = ALLOC; type < NUM_TYPES; type++) {
+    if (lat->num[type] == 0)
+      continue;
+    printf("  %-10s %10lu%8lu%8lu%8lu%8lu%10lu\n", names[type],
+           (unsigned long)lat->num[type],
+           (unsigned long)lat_percentile(lat, type, 0.5),
+           (unsigned long)lat_percentile(lat, type, 0.9),
+           (unsigned long)lat_percentile(lat, type, 0.99),
+           (unsigned long)lat_percentile(lat, type, 0.999),
+           (unsigned long)lat->max[type]);
+  }
+
+  for (int i = 0; i < lat->num_slowest; i++) {
+    traceop_t *op = &lat->slowest[i].op;
+    printf("  slow: line %d %s", LINENUM(lat->slowest[i].opnum),
+           names[op->type]);
+    if (op->type == FREE)
+      printf(" %d", op->index);
+    else if (op->type == FREE_BATCH)
+      printf(" %d %d", op->index, op->count);
+    else if (op->type == ALLOC_BATCH)
+      printf(" %d %d %zu", op->index, op->count, (size_t)op->size);
+    else
+      printf(" %d %zu", op->index, (size_t)op->size);
+    printf(": %lu ns\n", (unsigned long)lat->slowest[i].ns);
+  }
 }
@@ -3,6 +3,7 @@
  *            allows us to interleave calls from the student's malloc package
  *            with the system's malloc package in libc.
  */
+#define _GNU_SOURCE /* mremap */
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -11,58 +12,340 @@
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <stdint.h>
+#include <pthread.h>
 
 #include "memlib.h"
 
+#ifndef HUGEPAGES
+#define HUGEPAGES MEM_PAGES
+#endif
+
+/* Only the thread-safe build calls mem_sbrk and the mappings from many threads
+ * at once, the others use plain loads and stores of the counters */
+#ifdef THREADS
+#define LOAD(var) __atomic_load_n(&(var), __ATOMIC_RELAXED)
+#define ADD(var, n) __atomic_fetch_add(&(var), n, __ATOMIC_RELAXED)
+#define CAS(var, old, new)                                                     \
+  __atomic_compare_exchange_n(&(var), &(old), new, 1, __ATOMIC_RELAXED,        \
+                              __ATOMIC_RELAXED)
+#else
+#define LOAD(var) (var)
+#define ADD(var, n) ((var) += (n))
+#define CAS(var, old, new) ((var) = (new), 1)
+#endif
+
 /* private variables */
+static size_t max_heap = MAX_HEAP; /* Size of the heap area */
+static size_t heap_len;            /* ... and of its current mapping */
+static int hugepages = HUGEPAGES;  /* Backing asked for by mem_hugepages */
+static int backing = MEM_PAGES;    /* ... and the one the heap got */
 static unsigned char *heap;
 static unsigned char *mem_brk;
 static unsigned char *mem_max_addr;
+static size_t mem_peak; /* Largest heap size (with mappings) since reset */
+static unsigned char *mem_dirty;   /* Memory from here on still reads as 0 */
+static unsigned char *reserved_lo; /* Lowest address taken by mem_reserve */
+
+/* Memory mapped with mem_map, outside of the heap */
+#define MAX_MAPPINGS 1024
+
+static struct {
+  unsigned char *start;
+  size_t len;
+} mappings[MAX_MAPPINGS];
+static int num_mappings;
+static size_t mem_mapped; /* Total length of the mappings */
+static pthread_mutex_t mappings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * update_peak - remember the current size of the heap with mappings,
+ *    if it is the largest so far
+ */
+static void update_peak(void) {
+  size_t size = (size_t)(LOAD(mem_brk) - heap) + LOAD(mem_mapped);
+  size_t peak = LOAD(mem_peak);
+
+  while (size > peak && !CAS(mem_peak, peak, size))
+    ;
+}
+
+/*
+ * mem_max_heap - set the size of the heap area that the next mem_init maps
+ *    (if size > 0), and return the previous value. The area only reserves
+ *    address space, so it can be much larger than the memory of the machine.
+ */
+size_t mem_max_heap(size_t size) {
+  size_t old = max_heap;
+  if (size > 0)
+    max_heap = size;
+  return old;
+}
+
+/*
+ * mem_hugepages - set the backing of the heap area for the next mem_init
+ *    (if backing >= 0), and return the previous value. Huge pages that the
+ *    system can't provide fall back to the next smaller kind.
+ */
+int mem_hugepages(int backing) {
+  int old = hugepages;
+  if (backing >= 0)
+    hugepages = backing;
+  return old;
+}
+
+/*
+ * map_heap - map the heap area with the given flags, or return MAP_FAILED
+ */
+static unsigned char *map_heap(int flags) {
+  return mmap((void *)0x800000000,           /* suggested start, 2 MB aligned */
+              heap_len,                      /* length */
+              PROT_WRITE,                    /* permissions */
+              MAP_PRIVATE | MAP_ANON | flags, /* private or shared? */
+              -1,                            /* fd */
+              0);                            /* offset (dunno) */
+}
 
 /*
  * mem_init - initialize the memory system model
  */
 void mem_init(void) {
-  heap = mmap((void *)0x800000000,    /* suggested start */
-              MAX_HEAP,               /* length */
-              PROT_WRITE,             /* permissions */
-              MAP_PRIVATE | MAP_ANON, /* private or shared? */
-              -1,                     /* fd */
-              0);                     /* offset (dunno) */
-  mem_max_addr = heap + MAX_HEAP;
+  heap_len = (max_heap + HUGE_PAGE_SIZE - 1) & -HUGE_PAGE_SIZE;
+  heap = MAP_FAILED;
+  backing = MEM_PAGES;
+  /* Huge pages are reserved up front, so a pool that is too small fails
+   * here and not with SIGBUS on first touch */
+  if (hugepages == MEM_HUGETLB &&
+      (heap = map_heap(MAP_HUGETLB)) != MAP_FAILED)
+    backing = MEM_HUGETLB;
+  else if ((heap = map_heap(MAP_NORESERVE)) != MAP_FAILED &&
+           hugepages != MEM_PAGES &&
+           madvise(heap, heap_len, MADV_HUGEPAGE) == 0)
+    backing = MEM_THP;
+  if (heap == MAP_FAILED) {
+    fprintf(stderr, "ERROR: mem_init could not map %zu bytes\n", heap_len);
+    exit(1);
+  }
+  mem_max_addr = heap + heap_len;
   mem_brk = heap; /* heap is empty initially */
+  mem_peak = 0;
+  mem_dirty = heap;
+  reserved_lo = mem_max_addr;
 }
 
 /*
  * mem_deinit - free the storage used by the memory system model
  */
 void mem_deinit(void) {
-  munmap(heap, MAX_HEAP);
+  munmap(heap, heap_len);
 }
 
 /*
- * mem_reset_brk - reset the simulated brk pointer to make an empty heap
+ * mem_reset_brk - reset the simulated brk pointer to make an empty heap,
+ *    and drop all the mappings
  */
 void mem_reset_brk() {
+  for (int i = 0; i < num_mappings; i++)
+    munmap(mappings[i].start, mappings[i].len);
+  num_mappings = 0;
+  mem_mapped = 0;
   mem_brk = heap;
+  mem_peak = 0;
+  mem_max_addr = heap + heap_len;
+}
+
+/* page_up - round addr up to a page boundary */
+static void *page_up(void *addr) {
+  size_t page = mem_heap_pagesize();
+  return (void *)(((uintptr_t)addr + page - 1) & -page);
+}
+
+/*
+ * update_dirty - keep track of the memory above brk that may have been
+ *    written, after the heap has grown or shrunk from old_brk to new_brk
+ */
+static void update_dirty(unsigned char *old_brk, unsigned char *new_brk) {
+  unsigned char *dirty = LOAD(mem_dirty);
+  unsigned char *end = page_up(old_brk);
+
+  if (new_brk > old_brk) {
+    while (new_brk > dirty && !CAS(mem_dirty, dirty, new_brk))
+      ;
+  } else if (dirty <= end) {
+    /* Nothing above the old brk was written, so when its last page is given
+     * back too, all memory above the new brk reads as zero */
+    unsigned char *clean = page_up(new_brk);
+    if (mem_release(new_brk, end - new_brk) == (size_t)(end - clean))
+      (void)CAS(mem_dirty, dirty, clean);
+  } else {
+    mem_release(new_brk, old_brk - new_brk);
+  }
 }
 
 /*
  * mem_sbrk - simple model of the sbrk function. Extends the heap
- *    by incr bytes and returns the start address of the new area. In
- *    this model, the heap cannot be shrunk.
+ *    by incr bytes and returns the start address of the new area.
+ *    A negative incr shrinks the heap, and the whole pages above the
+ *    new brk are given back to the OS. With -DTHREADS the brk pointer
+ *    is moved with compare-and-swap, so concurrent calls are safe.
  */
 void *mem_sbrk(long incr) {
-  unsigned char *old_brk = mem_brk;
+  unsigned char *old_brk = LOAD(mem_brk);
+
+  do {
+    if (((old_brk + incr) < heap) || ((old_brk + incr) > mem_max_addr)) {
+      errno = ENOMEM;
+      fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
+      return (void *)-1;
+    }
+  } while (!CAS(mem_brk, old_brk, old_brk + incr));
+
+  if (incr >= 0)
+    update_peak();
+  update_dirty(old_brk, old_brk + incr);
+
+  return (void *)old_brk;
+}
+
+/*
+ * mem_release - give the whole pages between start and start + len back
+ *    to the OS. The memory stays mapped and reads as zero afterwards.
+ *    Returns the number of bytes released. The pages are those of
+ *    mem_heap_pagesize.
+ */
+size_t mem_release(void *start, size_t len) {
+  size_t page = mem_heap_pagesize();
+  uintptr_t lo = ((uintptr_t)start + page - 1) & -page;
+  uintptr_t hi = ((uintptr_t)start + len) & -page;
 
-  if ((incr < 0) || ((mem_brk + incr) > mem_max_addr)) {
+  if (hi <= lo || madvise((void *)lo, hi - lo, MADV_DONTNEED) < 0)
+    return 0;
+  return hi - lo;
+}
+
+/*
+ * mem_reserve - take incr bytes from the top of the heap area, so that
+ *    mem_sbrk never hands them out, and return the start of that area.
+ *    Reservations are dropped by mem_reset_brk. Unlike mem_sbrk, this
+ *    is not safe to call concurrently.
+ */
+void *mem_reserve(long incr) {
+  if ((incr < 0) || ((mem_max_addr - incr) < mem_brk)) {
     errno = ENOMEM;
-    fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
+    fprintf(stderr, "ERROR: mem_reserve failed. Ran out of memory...\n");
     return (void *)-1;
   }
 
-  mem_brk += incr;
-  return (void *)old_brk;
+  mem_max_addr -= incr;
+  if (mem_max_addr < reserved_lo)
+    reserved_lo = mem_max_addr;
+  return (void *)mem_max_addr;
+}
+
+/*
+ * mem_clean_lo - return the lowest address from which all the memory that
+ *    mem_sbrk can still hand out reads as zero. Pages written before a
+ *    mem_reset_brk keep their contents, so this is usually mem_brk only
+ *    after the heap grew past its earlier peak.
+ */
+void *mem_clean_lo(void) {
+  unsigned char *brk = LOAD(mem_brk);
+  unsigned char *dirty = LOAD(mem_dirty);
+
+  /* An area reserved earlier may have been written, and is free again */
+  if (mem_max_addr > reserved_lo)
+    return mem_max_addr;
+  return dirty > brk ? dirty : brk;
+}
+
+/*
+ * mem_map - map len bytes of zeroed memory outside of the heap and return
+ *    its page-aligned start, or -1. The mapping counts towards the heap
+ *    size reported by mem_peak_heapsize.
+ */
+void *mem_map(size_t len) {
+  void *start = (void *)-1;
+
+  pthread_mutex_lock(&mappings_lock);
+  if (num_mappings == MAX_MAPPINGS) {
+    errno = ENOMEM;
+  } else if ((start = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANON, -1, 0)) != MAP_FAILED) {
+    mappings[num_mappings].start = start;
+    mappings[num_mappings].len = len;
+    num_mappings++;
+    ADD(mem_mapped, len);
+    update_peak();
+  }
+  pthread_mutex_unlock(&mappings_lock);
+  return start;
+}
+
+/* find_mapping - return the index of the mapping that starts at start */
+static int find_mapping(void *start) {
+  for (int i = num_mappings - 1; i >= 0; i--)
+    if (mappings[i].start == start)
+      return i;
+  return -1;
+}
+
+/*
+ * mem_unmap - unmap the memory returned by mem_map or mem_remap
+ */
+void mem_unmap(void *start) {
+  pthread_mutex_lock(&mappings_lock);
+  int i = find_mapping(start);
+  assert(i >= 0);
+  munmap(start, mappings[i].len);
+  ADD(mem_mapped, -mappings[i].len);
+  mappings[i] = mappings[--num_mappings];
+  pthread_mutex_unlock(&mappings_lock);
+}
+
+/*
+ * mem_remap - change the length of a mapping to len bytes, moving it if
+ *    needed, without copying. Returns the new start, or -1 if the mapping
+ *    could not be resized, in which case it is left untouched.
+ */
+void *mem_remap(void *start, size_t len) {
+  pthread_mutex_lock(&mappings_lock);
+  int i = find_mapping(start);
+  assert(i >= 0);
+  void *new_start = mremap(start, mappings[i].len, len, MREMAP_MAYMOVE);
+  if (new_start != MAP_FAILED) {
+    ADD(mem_mapped, len - mappings[i].len);
+    mappings[i].start = new_start;
+    mappings[i].len = len;
+    update_peak();
+  }
+  pthread_mutex_unlock(&mappings_lock);
+  return new_start;
+}
+
+/*
+ * mem_in_mapping - return 1 if the bytes from lo to hi (inclusive) lie
+ *    within one mapping, 0 otherwise
+ */
+int mem_in_mapping(void *lo, void *hi) {
+  int found = 0;
+
+  pthread_mutex_lock(&mappings_lock);
+  for (int i = 0; i < num_mappings && !found; i++) {
+    unsigned char *start = mappings[i].start;
+    found = (unsigned char *)lo >= start &&
+            (unsigned char *)hi < start + mappings[i].len;
+  }
+  pthread_mutex_unlock(&mappings_lock);
+  return found;
+}
+
+/*
+ * mem_in_reserve - return 1 if the bytes from lo to hi (inclusive) lie
+ *    within the area taken by mem_reserve, 0 otherwise
+ */
+int mem_in_reserve(void *lo, void *hi) {
+  return (unsigned char *)lo >= mem_max_addr &&
+         (unsigned char *)hi < heap + heap_len;
 }
 
 /*
@@ -76,7 +359,7 @@ void *mem_heap_lo() {
  * mem_heap_hi - return address of last heap byte
  */
 void *mem_heap_hi() {
-  return (void *)(mem_brk - 1);
+  return (void *)(LOAD(mem_brk) - 1);
 }
 
 /*
@@ -86,9 +369,33 @@ size_t mem_heapsize() {
   return (size_t)((void *)mem_brk - (void *)heap);
 }
 
+/*
+ * mem_peak_heapsize() - returns the largest size in bytes of the heap
+ *    together with the mappings since the last mem_reset_brk
+ */
+size_t mem_peak_heapsize() {
+  return mem_peak;
+}
+
 /*
  * mem_pagesize() - returns the page size of the system
  */
 size_t mem_pagesize() {
   return (size_t)getpagesize();
 }
+
+/*
+ * mem_heap_pagesize() - returns the size of the pages of the heap area, which
+ *    is the huge page size with MAP_HUGETLB, the page size otherwise
+ */
+size_t mem_heap_pagesize() {
+  return backing == MEM_HUGETLB ? HUGE_PAGE_SIZE : mem_pagesize();
+}
+
+/*
+ * mem_hugepagesize() - returns the size of the huge pages backing the heap
+ *    area, or 0 if it has normal pages
+ */
+size_t mem_hugepagesize() {
+  return backing == MEM_PAGES ? 0 : HUGE_PAGE_SIZE;
+}
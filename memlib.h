@@ -8,15 +8,42 @@
 #define ALIGNMENT 16
 
 /*
- * Maximum heap size in bytes
+ * Maximum heap size in bytes, the default for mem_max_heap. The 64-bit heap
+ * layout of mm.c (-DWIDE) is meant for much larger heaps.
  */
+#ifndef MAX_HEAP
+#ifdef WIDE
+#define MAX_HEAP (64UL << 30) /* 64 GB */
+#else
 #define MAX_HEAP (100 * (1 << 20)) /* 100 MB */
+#endif
+#endif
+
+/*
+ * Backing of the heap area (see mem_hugepages): normal pages, transparent
+ * huge pages or huge pages of MAP_HUGETLB
+ */
+enum { MEM_PAGES, MEM_THP, MEM_HUGETLB };
+#define HUGE_PAGE_SIZE (2 * (1 << 20))
 
 void mem_init(void);
+size_t mem_max_heap(size_t size);
+int mem_hugepages(int backing);
 void mem_deinit(void);
 void *mem_sbrk(long incr);
+void *mem_reserve(long incr);
 void mem_reset_brk(void);
+size_t mem_release(void *start, size_t len);
+void *mem_map(size_t len);
+void mem_unmap(void *start);
+void *mem_remap(void *start, size_t len);
+int mem_in_mapping(void *lo, void *hi);
+int mem_in_reserve(void *lo, void *hi);
+void *mem_clean_lo(void);
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
 size_t mem_heapsize(void);
+size_t mem_peak_heapsize(void);
 size_t mem_pagesize(void);
+size_t mem_heap_pagesize(void);
+size_t mem_hugepagesize(void);
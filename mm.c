@@ -13,6 +13,25 @@
  * It contains 9 buckets storing free blocks of sizes:
  * 16, 32, (32.64], (64.128], (128, 256], (256, 512], (512, 1024], (1024, 2048],
  * and the last one with blocks bigger than 2048 bytes.
+ * When compiled with -DTLSF, a two-level scheme is used instead: one bucket
+ * per 16 bytes below 128 bytes, then every power-of-two range is split into
+ * 8 buckets, up to 1 MB. A bitmap of non-empty buckets lets find_fit jump to
+ * the next bucket that may hold a fit with a single ctz.
+ * The last bucket is a treap ordered by block size, with equal-size blocks
+ * chained off a single tree node, so the best fit among large blocks is found
+ * in O(log n) instead of scanning the whole list.
+ * When compiled with -DSLAB, requests of at most 256 bytes are served from
+ * page-sized runs of equal-size objects without boundary tags (see slab runs).
+ * When compiled with -DTHREADS, the heap is split into NUM_ARENAS arenas, each
+ * with its own segregated list and lock, and threads are assigned to arenas in
+ * round-robin order. A block is always freed to the arena that contains it.
+ * Every thread also caches a few recently freed blocks of each small size
+ * class, so most small requests never take a lock.
+ * Requests of at least MMAP_THRESHOLD (4 MB) bytes get a mapping of their own
+ * from mem_map, outside of the heap (see mapped blocks).
+ * When compiled with -DTRIM, a large free block at the end of the heap is cut
+ * off with a negative mem_sbrk, and the pages of large free blocks inside the
+ * heap are periodically given back to the OS (see returning memory).
  *
  * The minimum size of the allocated/free block is 16 bytes,
  * because of the 16-byte alignment requirement.
@@ -26,6 +45,9 @@
  * from the beginning of the heap. Thanks to this, we don't need to store
  * pointers, which would increase the minimum block size to 32 bytes,
  * we only store two 4-byte numbers.
+ * When compiled with -DWIDE, headers, footers and these numbers take 8 bytes
+ * instead, so blocks and heaps can be larger than 4 GB, at the cost of 4 more
+ * bytes per block and a minimum block size of 32 bytes.
  *
  * In this approach, a block is allocated by searching for the best fit free
  * block on the segregated list. We search for the suitable bucket,
@@ -40,8 +62,9 @@
  * free. We add the new free block at the front of the free_list of appropriate
  * index.
  *
- * Realloc function checks if the block on the left is free,
- * if so, it can be used when increasing the block size.
+ * Realloc function checks if the block on the right is free,
+ * if so, it can be used when increasing the block size. If it is not enough,
+ * the free block on the left is used as well, and the payload is moved.
  * If the amount of free space is not enough but the block is at the end of the
  * heap, we execute extend heap, otherwise we execute malloc to allocate the new
  * block of the requested size and free the old block.
@@ -49,6 +72,7 @@
  */
 
 #include <assert.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -79,36 +103,317 @@
 #define free mm_free
 #define realloc mm_realloc
 #define calloc mm_calloc
+#define memalign mm_memalign
+#define posix_memalign mm_posix_memalign
+#define aligned_alloc mm_aligned_alloc
+#define malloc_usable_size mm_usable_size
+#define free_sized mm_free_sized
 #endif /* def DRIVER */
 
+#ifdef THREADS
+#include <pthread.h>
+
+/* The allocator below is not thread-safe on its own, so in the thread-safe
+ * build it is compiled under internal names. The exported functions at the
+ * end of this file wrap it with the per-thread cache and the arena locks. */
+#undef malloc
+#undef free
+#undef realloc
+#undef calloc
+#undef memalign
+#undef free_sized
+#define malloc heap_malloc
+#define free heap_free
+#define realloc heap_realloc
+#define calloc heap_calloc
+#define memalign heap_memalign
+#define free_sized heap_free_sized
+#define mm_malloc_batch heap_malloc_batch
+
+static void *malloc(size_t size);
+static void free(void *ptr);
+static void free_sized(void *ptr, size_t size);
+static void *realloc(void *ptr, size_t size);
+static void *calloc(size_t nmemb, size_t size);
+static void *memalign(size_t alignment, size_t size);
+static size_t mm_malloc_batch(size_t size, size_t n, void **out);
+
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+static void tcache_key_create(void);
+static void tcache_drop(void);
+#endif /* THREADS */
+
 /* --=[ global values and macros ]=------------------------------------------*/
 /* Macros from CSAPP book */
-#define WSIZE 4 /* Word and header/footer size (bytes) */
+#ifdef WIDE
+#define WSIZE 8 /* Word and header/footer size (bytes) */
+#else
+#define WSIZE 4
+#endif
 
 /* Pack a size and allocated bit into a word */
 #define PACK(size, alloc) ((size) | (alloc))
 
 /* Write a word at address p */
-#define PUT(p, val) (*(unsigned int *)(p) = (val))
+#define PUT(p, val) (*(word_t *)(p) = (val))
 
 /* From mm-implicit.c file */
+#ifdef WIDE
+typedef int64_t word_t;
+#else
 typedef int32_t word_t; /* Heap is bascially an array of 4-byte words. */
+#endif
+
+/* A free block holds its header, two list links and its footer */
+#define MIN_BLOCK (4 * WSIZE > ALIGNMENT ? 4 * WSIZE : ALIGNMENT)
 
 typedef enum {
   FREE = 0,     /* Block is free */
   USED = 1,     /* Block is used */
   PREVFREE = 2, /* Previous block is free (optimized boundary tags) */
+  MAPPED = 4,   /* Used block has a mapping of its own, see mapped blocks */
+  RELEASED = 4, /* Free block has its pages given back, see calloc */
+  GROWN = 8,    /* Used block has been grown by realloc */
+  RESERVED = 8, /* Free block is kept for the growing block before it */
 } bt_flags;
 
-/* global pointers */
-static word_t *heap_start; /* Address of the first block */
-static word_t *heap_end;   /* Address past last byte of last block */
-static word_t *last;       /* Points at last block */
+/* --=[ segregated list ]=------------------------------------------ */
+
+#ifdef TLSF
+/* Two-level size classes (as in TLSF). Blocks smaller than 2^FL_MIN bytes get
+ * one class per 16-byte size. Every bigger power-of-two range [2^fl, 2^(fl+1))
+ * is split into SL_COUNT equally wide classes. Blocks of 2^FL_MAX bytes and
+ * more share the last bucket. */
+#define SL_SHIFT 3
+#define SL_COUNT (1 << SL_SHIFT)
+#define FL_MIN 7
+#define FL_MAX 20
+#define NUM_SMALL ((1 << FL_MIN) / ALIGNMENT - 1)            /* 16..112 */
+#define NUM_LIST (NUM_SMALL + (FL_MAX - FL_MIN) * SL_COUNT + 1) /* 112 */
+
+/* Find the index of a list that contains blocks of a given size */
+static inline word_t get_index(size_t size) {
+  if (size < (1 << FL_MIN))
+    return size / ALIGNMENT - 1;
+  word_t fl = 63 - __builtin_clzl(size);
+  if (fl >= FL_MAX)
+    return NUM_LIST - 1;
+  word_t sl = (size >> (fl - SL_SHIFT)) & (SL_COUNT - 1);
+  return NUM_SMALL + (fl - FL_MIN) * SL_COUNT + sl;
+}
+#else
+#define NUM_LIST 9 /* Number of buckets */
+
+/* The following buckets consist of the following size of blocks (in the ranges:
+ * e.g. 2 (segregated_list[2]) bucket are blocks in the range (32, 64] bytes*/
+/*
+#define SIZE0 16
+#define SIZE1 32
+#define SIZE2 64
+#define SIZE3 128
+#define SIZE4 256
+#define SIZE5 512
+#define SIZE6 1024
+#define SIZE7 2048
+#define SIZE8 4096*/
+
+/* Binsearch to find the index of a list that contains blocks of a given size */
+static inline word_t get_index(size_t size) {
+  if (size <= 512) {
+    if (size <= 64) {
+      if (size == 16)
+        return 0;
+      if (size == 32)
+        return 1;
+      return 2;
+    } else if (size <= 256) {
+      if (size <= 128)
+        return 3;
+      return 4;
+    }
+    return 5;
+  }
+  if (size <= 2048) {
+    if (size <= 1024)
+      return 6;
+    return 7;
+  }
+  return 8;
+}
+#endif /* !TLSF */
+
+/* An extra bucket after the last one holds the soft reservations, see
+ * realloc. Its head is kept apart from the others (see optional_t). */
+#define RESERVED_INDEX NUM_LIST
+
+/* Bitmap of non-empty buckets, see below */
+#define BITMAP_WORDS ((NUM_LIST + 1 + 63) / 64)
+
+#ifdef SLAB
+/* --=[ slab runs ]=-------------------------------------------------------- */
+/* Requests of at most SLAB_MAX bytes are served from runs. A run is an
+ * ordinary used block of RUN_SIZE bytes, whose payload is aligned to RUN_SIZE.
+ * It starts with a run header and then holds objects of a single size class,
+ * without any boundary tags. Free objects form a LIFO list inside the run
+ * (the first 2 bytes of a free object are the offset of the next one), and
+ * the part of the run that was never used is handed out by a bump offset.
+ *
+ * Each RUN_SIZE page of the heap has a bit in slab_pages, that is set if a run
+ * starts at that page. This is how free tells slab objects apart. Runs that
+ * become empty are freed like any other block. */
+#define RUN_SIZE 4096
+#define SLAB_MAX 256
+#define SLAB_CLASSES (SLAB_MAX / ALIGNMENT)
+#define SLAB_PAGES (MAX_HEAP / RUN_SIZE)
+
+typedef struct {
+  uint16_t size;  /* Size of the objects */
+  uint16_t nused; /* Number of allocated objects */
+  uint16_t free;  /* Offset of the first free object or 0 */
+  uint16_t bump;  /* Offset of the first never used object */
+  word_t next;    /* Next run of this class with free objects */
+  word_t prev;    /* Previous run of this class with free objects */
+} run_t;
+
+static uint64_t *slab_pages; /* Bit per page, set if a run starts there */
+#endif /* SLAB */
+
+/* --=[ quick lists ]=------------------------------------------------------ */
+/* With mm_quick_limit, freed blocks of up to QUICK_MAX bytes first go to a
+ * list of their exact size. They stay marked as used, so they are neither
+ * coalesced nor given away by find_fit, and the next malloc of that size takes
+ * one back at once. All the lists are coalesced together when find_fit fails
+ * or one of them grows past the limit. */
+#ifndef QUICK_MAX
+#define QUICK_MAX 256
+#endif
+#ifndef QUICK_LIMIT
+#define QUICK_LIMIT 0 /* coalesce at once */
+#endif
+#define QUICK_CLASSES (QUICK_MAX / ALIGNMENT)
+
+/* The lists of an arena follow its header, and only when mm_init finds them
+ * enabled, so that they don't take room in the heap otherwise */
+typedef struct {
+  word_t head[QUICK_CLASSES]; /* First block of each quick list, or -1 */
+  word_t len[QUICK_CLASSES];  /* ... and the number of blocks on it */
+} quick_t;
+
+static int quick_limit = QUICK_LIMIT;
+
+/* --=[ placement ]=-------------------------------------------------------- */
+/* find_fit takes a block from the first bucket, from the one of the request
+ * up, that has any large enough. Which one is up to mm_fit_policy (see mm.h).
+ * A good fit is the smallest one seen once GOOD_FIT_PROBES blocks were looked
+ * at, or the first one at most GOOD_FIT_SLACK percent too large. The tree of
+ * large blocks and the reservations are always searched for the best fit. */
+#ifndef FIT_POLICY
+#define FIT_POLICY FIT_BEST
+#endif
+#ifndef FREE_ORDER
+#define FREE_ORDER FREE_LIFO
+#endif
+#ifndef GOOD_FIT_PROBES
+#define GOOD_FIT_PROBES 8
+#endif
+#ifndef GOOD_FIT_SLACK
+#define GOOD_FIT_SLACK 12
+#endif
+
+#ifndef REALLOC_RESERVE
+#define REALLOC_RESERVE 0 /* Off unless asked for, see realloc */
+#endif
+
+static int fit_policy = FIT_POLICY;
+static int free_order = FREE_ORDER;
+static int reserve_percent = REALLOC_RESERVE;
+
+/* Next fit and the soft reservations of realloc are off by default, so their
+ * state follows the arena header, like the quick lists, only when mm_init
+ * finds either of them enabled */
+typedef struct {
+  word_t *reserved;   /* The RESERVED_INDEX bucket */
+  word_t *rover;      /* Where the next fit search of its bucket starts, */
+  word_t rover_index; /* ... which is this one */
+} optional_t;
+
+/* --=[ arenas ]=----------------------------------------------------------- */
+/* All the state of the allocator is kept in the header of the heap. With
+ * -DTHREADS there are NUM_ARENAS such heaps, called arenas. Arena 0 is the
+ * brk heap, the others live in ARENA_SIZE regions reserved from the top of
+ * memlib heap, with the arena header at the start of the region. */
+typedef struct {
+  word_t *heap_start; /* Address of the first block */
+  word_t *heap_end;   /* Address past last byte of last block */
+  word_t *last;       /* Points at last block */
+#ifdef TRIM
+  size_t dirty; /* Bytes freed since pages were last released */
+#endif
+#ifdef THREADS
+  void *brk;      /* End of used part of the arena region (not in arena 0) */
+  void *max_addr; /* End of the arena region */
+  pthread_mutex_t lock;
+  void *remote; /* Blocks freed by other threads, linked through payloads */
+#endif
+  uint64_t nonempty[BITMAP_WORDS]; /* Bit set for each non-empty bucket */
+  word_t *segregated_list[NUM_LIST];
+#ifdef SLAB
+  word_t slab_runs[SLAB_CLASSES]; /* Runs with free objects, for each class */
+#endif
+  quick_t *quick;       /* Quick lists, NULL if they were off in mm_init */
+  optional_t *optional; /* Next fit and reservations, NULL if both were off */
+  size_t grow;          /* Surplus of next heap extension, see extend_heap */
+#ifdef BLOCK_MAP
+  uint64_t *map;  /* Start and used bits of every granule (see block map) */
+  size_t map_len; /* Length of its mapping */
+#endif
+#ifdef STATS
+  mm_stats_t *stats;
+#endif
+} arena_t;
+
+/* With -DSTATS, every arena counts what the allocator does (see mm_stats).
+ * The counters are static, not in the arena header, so that the heap looks
+ * the same as in other builds, where the counters and their updates are
+ * compiled out. */
+#ifdef STATS
+#if NUM_LIST + 1 > MM_STATS_BUCKETS
+#error "MM_STATS_BUCKETS is too small for NUM_LIST"
+#endif
+#define STAT(expr) expr
+#else
+#define STAT(expr)
+#endif
+
+#ifdef THREADS
+#ifndef NUM_ARENAS
+#define NUM_ARENAS 4
+#endif
+#ifndef ARENA_SIZE
+#define ARENA_SIZE (8 * (1 << 20))
+#endif
+
+static __thread arena_t *arena; /* Arena that the allocator works on */
+static __thread arena_t *home;  /* Arena assigned to this thread */
+static void *arenas_lo;         /* Start of region of arena 1 */
+static int next_arena;          /* Arena of the next new thread */
+#else
+static arena_t *arena; /* The only arena */
+#endif
+static arena_t *main_arena; /* Arena 0 */
+
+#ifdef STATS
+#ifdef THREADS
+static mm_stats_t arena_stats[NUM_ARENAS];
+#else
+static mm_stats_t arena_stats[1];
+#endif
+#endif
 
 /* --=[ boundary tag handling ]=-------------------------------------------- */
 /* from mm-implicit.c file */
 static inline size_t bt_size(word_t *bt) {
-  return *bt & ~(USED | PREVFREE);
+  return *bt & ~(USED | PREVFREE | MAPPED | GROWN);
 }
 
 static inline int bt_used(word_t *bt) {
@@ -124,15 +429,29 @@ static inline bt_flags bt_get_prevfree(word_t *bt) {
   return *bt & PREVFREE;
 }
 
+/* The flag is in the header of the next block, which may be used, and with
+ * -DTHREADS other threads read the header of a used block without the lock of
+ * its arena (see tcache_block_index), so it is flipped with an atomic
+ * operation there. */
+
 /* clear prevfree flag */
 static inline void bt_clr_prevfree(word_t *bt) {
-  if (bt)
-    *bt &= ~PREVFREE;
+  if (bt == NULL)
+    return;
+#ifdef THREADS
+  __atomic_fetch_and(bt, ~PREVFREE, __ATOMIC_RELAXED);
+#else
+  *bt &= ~PREVFREE;
+#endif
 }
 
 /* set prevfree flag */
 static inline void bt_set_prevfree(word_t *bt) {
+#ifdef THREADS
+  __atomic_fetch_or(bt, PREVFREE, __ATOMIC_RELAXED);
+#else
   *bt |= PREVFREE;
+#endif
 }
 
 /* --=[ block handling procedures ]=----------------------------------------*/
@@ -155,7 +474,7 @@ static inline void *bt_payload(word_t *bt) {
 /* Returns address of next block or NULL. */
 static inline word_t *bt_next(word_t *block_ptr) {
   word_t *next = (void *)block_ptr + bt_size(block_ptr);
-  if (next <= heap_end)
+  if (next <= arena->heap_end)
     return next;
 
   return NULL;
@@ -164,14 +483,115 @@ static inline word_t *bt_next(word_t *block_ptr) {
 /* Returns address of previous block or NULL. */
 static inline word_t *bt_prev(word_t *block_ptr) {
   word_t *prev = (void *)block_ptr - bt_size(block_ptr - 1);
-  if (prev >= heap_start)
+  if (prev >= arena->heap_start)
     return prev;
 
   return NULL;
 }
 
+/* --=[ block map ]=------------------------------------------------------- */
+/* With -DBLOCK_MAP, every arena keeps a bitmap beside the heap with two bits
+ * for each ALIGNMENT-byte granule: whether a block starts there, and whether
+ * that block is used. bt_make keeps it in sync, and places that merge blocks
+ * without writing the header of the block that disappears clear its start bit.
+ * Heap walks can then find blocks from the map alone, and mm_checkheap compares
+ * the map with the boundary tags. Words 2i and 2i+1 hold the start and used
+ * bits of granules 64i to 64i+63, so one cache line covers 4 KB of heap. The
+ * map lives in a mapping of its own, which grows with the arena. */
+#ifdef BLOCK_MAP
+#define MAP(expr) expr
+#else
+#define MAP(expr)
+#endif
+
+#ifdef BLOCK_MAP
+static inline size_t map_granule(void *ptr) {
+  return (size_t)(ptr - (void *)arena) / ALIGNMENT;
+}
+
+/* Make the map cover the arena up to end, returns -1 if it can't grow */
+static int map_reserve(void *end) {
+  size_t page = mem_pagesize();
+  size_t len = (map_granule(end) / 64 + 1) * 2 * sizeof(uint64_t);
+  len = (len + page - 1) / page * page;
+  if (len <= arena->map_len)
+    return 0;
+  void *map = arena->map ? mem_remap(arena->map, len) : mem_map(len);
+  if (map == (void *)-1)
+    return -1;
+  arena->map = map;
+  arena->map_len = len;
+  return 0;
+}
+
+/* Record that a block starts at bt, and whether it is used */
+static inline void map_mark(word_t *bt, bool used) {
+  size_t g = map_granule(bt);
+  uint64_t bit = 1UL << (g % 64);
+  uint64_t *w = &arena->map[2 * (g / 64)];
+  w[0] |= bit;
+  if (used)
+    w[1] |= bit;
+  else
+    w[1] &= ~bit;
+}
+
+/* Forget the block at bt, which was merged into the one before it */
+static inline void map_absorb(word_t *bt) {
+  size_t g = map_granule(bt);
+  uint64_t bit = 1UL << (g % 64);
+  uint64_t *w = &arena->map[2 * (g / 64)];
+  w[0] &= ~bit;
+  w[1] &= ~bit;
+}
+
+static inline bool map_starts(word_t *bt, bool *used) {
+  size_t g = map_granule(bt);
+  uint64_t *w = &arena->map[2 * (g / 64)];
+  *used = w[1] >> (g % 64) & 1;
+  return w[0] >> (g % 64) & 1;
+}
+
+/* Returns the block after bt according to the map, or the epilogue */
+static word_t *map_next(word_t *bt) {
+  size_t g = map_granule(bt) + 1;
+  size_t end = map_granule(arena->heap_end);
+  size_t offset = (size_t)((void *)bt - (void *)arena) % ALIGNMENT;
+  for (size_t i = g / 64; i <= end / 64; i++) {
+    uint64_t bits = arena->map[2 * i];
+    if (i == g / 64)
+      bits &= ~0UL << (g % 64);
+    if (bits) {
+      g = i * 64 + __builtin_ctzl(bits);
+      if (g >= end)
+        break;
+      return (void *)arena + g * ALIGNMENT + offset;
+    }
+  }
+  return arena->heap_end;
+}
+
+/* Before the boundary tags of the block at bt are trusted, check that the map
+ * has a block starting there, and that both the map and the header say it is
+ * used (or free). This catches double frees, frees of pointers that are not
+ * blocks and headers overwritten by payloads when they are used, not at the
+ * next mm_checkheap. */
+static void map_verify(word_t *bt, bool used, const char *what) {
+  bool map_used;
+  if (bt == NULL || bt == arena->heap_end)
+    return;
+  if (!map_starts(bt, &map_used))
+    msg("ERROR: block map has no block at %s %p\n", what, bt);
+  else if (map_used != used || !!bt_used(bt) != used)
+    msg("ERROR: %s %p should be %s, block map says %s, header %s\n", what,
+        bt, used ? "used" : "free", map_used ? "used" : "free",
+        bt_used(bt) ? "used" : "free");
+}
+#endif
+
 /* Creates boundary tag(s) for given block. */
 static inline void bt_make(word_t *bt, size_t size, bt_flags flags) {
+  MAP(map_mark(bt, flags & USED));
   /* create header*/
   PUT(bt, PACK(size, flags));
   /* if new block is allocated, clear the prevfree flag in the next block*/
@@ -193,23 +613,25 @@ static size_t round_up(size_t size) {
   return (size_t)(size + ALIGNMENT - 1) & -ALIGNMENT;
 }
 
+/* Size of the block for a request of size bytes */
+static inline size_t block_size(size_t size) {
+  size_t asize = round_up(size + WSIZE);
+  return asize > MIN_BLOCK ? asize : MIN_BLOCK;
+}
+
 /* --=[ explicit list handling ]=------------------------------------------ */
 /* In the free block there is header, footer and two numbers representing the
  * distance from the heap_start pointer. If we add the first number to the
  * heap_start pointer, we get the address of the next free block, if we add the
  * second, we get the address of the previous block. */
 
-/* Global pointers */
-static word_t **segregated_list;
-static word_t *free_list_start;
-static word_t *last_free;
 /* Returns address of next free block or NULL. */
 static inline word_t *get_free_next(word_t *block_ptr) {
   word_t next = *(block_ptr + 1);
   if (next < 0)
     return NULL;
 
-  return heap_start + next;
+  return arena->heap_start + next;
 }
 
 /* Returns address of previous free block or NULL. */
@@ -218,188 +640,781 @@ static inline word_t *get_free_prev(word_t *block_ptr) {
   if (prev < 0)
     return NULL;
 
-  return heap_start + prev;
+  return arena->heap_start + prev;
 }
 
 /* Set address of next free block */
 static inline void set_free_next(word_t *block_ptr, word_t *next_block) {
-  *(block_ptr + 1) = (word_t)(next_block - heap_start);
+  *(block_ptr + 1) = (word_t)(next_block - arena->heap_start);
 }
 
 /* Set address of previous free block */
 static inline void set_free_prev(word_t *block_ptr, word_t *prev_block) {
-  *(block_ptr + 2) = (word_t)(prev_block - heap_start);
+  *(block_ptr + 2) = (word_t)(prev_block - arena->heap_start);
+}
+
+
+/* --=[ non-empty bucket bitmap ]=------------------------------------------ */
+/* Bit i is set if and only if segregated_list[i] is not empty, so find_fit can
+ * skip empty buckets with a single ctz instead of probing every one of them. */
+static inline void bitmap_set(word_t index) {
+  arena->nonempty[index / 64] |= 1UL << (index % 64);
+}
+
+static inline void bitmap_clr(word_t index) {
+  arena->nonempty[index / 64] &= ~(1UL << (index % 64));
+}
+
+/* Returns index of the first non-empty bucket >= index or NUM_LIST. */
+static inline word_t bitmap_find(word_t index) {
+  word_t w = index / 64;
+  if (w >= BITMAP_WORDS)
+    return NUM_LIST;
+  uint64_t bits = arena->nonempty[w] & (~0UL << (index % 64));
+  while (bits == 0) {
+    if (++w == BITMAP_WORDS)
+      return NUM_LIST;
+    bits = arena->nonempty[w];
+  }
+  return w * 64 + __builtin_ctzl(bits);
+}
+
+
+/* --=[ size-ordered tree of large blocks ]=------------------------------- */
+/* The last bucket is not a list but a treap keyed by block size. Each distinct
+ * size is stored once as a tree node, the other free blocks of the same size
+ * are chained off that node using the next/prev fields. The tree links are
+ * stored just like the list links - as distances from heap_start.
+ *
+ * Word layout of a free block in the tree:
+ * [0] header, [1] next in chain, [2] prev in chain (NULL for a tree node),
+ * [3] left child, [4] right child, [5] parent, [6] priority, ..., footer.
+ *
+ * Node priority is a hash of where the node was inserted, and it goes with
+ * the node: to the next block of its chain when the node is removed, and to
+ * the rest of the block when a split or a merge resizes the node in place,
+ * so neither needs a rotation. */
+#define TREE_INDEX (NUM_LIST - 1)
+
+#define TREE_NEXT 1
+#define TREE_PREV 2
+#define TREE_LEFT 3
+#define TREE_RIGHT 4
+#define TREE_PARENT 5
+#define TREE_PRIORITY 6
+
+static inline word_t *tree_get(word_t *block_ptr, int field) {
+  word_t offset = *(block_ptr + field);
+  if (offset < 0)
+    return NULL;
+
+  return arena->heap_start + offset;
+}
+
+static inline void tree_set(word_t *block_ptr, int field, word_t *ptr) {
+  *(block_ptr + field) = ptr ? (word_t)(ptr - arena->heap_start) : -1;
+}
+
+static inline uint32_t tree_priority(word_t *block_ptr) {
+  return (uint32_t)block_ptr[TREE_PRIORITY];
+}
+
+/* Make new take the place of old as a child of old's parent (or the root). */
+static inline void tree_replace_child(word_t *old, word_t *new) {
+  word_t *parent = tree_get(old, TREE_PARENT);
+  if (parent == NULL)
+    arena->segregated_list[TREE_INDEX] = new;
+  else if (tree_get(parent, TREE_LEFT) == old)
+    tree_set(parent, TREE_LEFT, new);
+  else
+    tree_set(parent, TREE_RIGHT, new);
+  if (new)
+    tree_set(new, TREE_PARENT, parent);
+}
+
+/* Rotate node up above its parent, keeping the search order. */
+static void tree_rotate_up(word_t *node) {
+  word_t *parent = tree_get(node, TREE_PARENT);
+  tree_replace_child(parent, node);
+  if (tree_get(parent, TREE_LEFT) == node) {
+    word_t *child = tree_get(node, TREE_RIGHT);
+    tree_set(parent, TREE_LEFT, child);
+    if (child)
+      tree_set(child, TREE_PARENT, parent);
+    tree_set(node, TREE_RIGHT, parent);
+  } else {
+    word_t *child = tree_get(node, TREE_LEFT);
+    tree_set(parent, TREE_RIGHT, child);
+    if (child)
+      tree_set(child, TREE_PARENT, parent);
+    tree_set(node, TREE_LEFT, parent);
+  }
+  tree_set(parent, TREE_PARENT, node);
+}
+
+/* Insert the free block into the tree, or into the chain of its size. */
+static void tree_insert(word_t *block_ptr) {
+  size_t size = bt_size(block_ptr);
+  word_t *parent = NULL;
+  int field = TREE_LEFT;
+
+  for (word_t *node = arena->segregated_list[TREE_INDEX]; node != NULL;
+       node = tree_get(node, field)) {
+    if (bt_size(node) == size) {
+      /* Put the block right after the node in its chain */
+      word_t *next = get_free_next(node);
+      set_free_prev(block_ptr, node);
+      tree_set(block_ptr, TREE_NEXT, next);
+      if (next)
+        set_free_prev(next, block_ptr);
+      set_free_next(node, block_ptr);
+      return;
+    }
+    parent = node;
+    field = size < bt_size(node) ? TREE_LEFT : TREE_RIGHT;
+  }
+
+  tree_set(block_ptr, TREE_NEXT, NULL);
+  tree_set(block_ptr, TREE_PREV, NULL);
+  tree_set(block_ptr, TREE_LEFT, NULL);
+  tree_set(block_ptr, TREE_RIGHT, NULL);
+  tree_set(block_ptr, TREE_PARENT, parent);
+  uint32_t priority = (uint32_t)(block_ptr - arena->heap_start) * 0x9E3779B1u;
+  priority ^= priority >> 16;
+  block_ptr[TREE_PRIORITY] = (word_t)priority;
+  if (parent == NULL) {
+    arena->segregated_list[TREE_INDEX] = block_ptr;
+    bitmap_set(TREE_INDEX);
+    return;
+  }
+  tree_set(parent, field, block_ptr);
+
+  while ((parent = tree_get(block_ptr, TREE_PARENT)) != NULL &&
+         tree_priority(parent) < priority)
+    tree_rotate_up(block_ptr);
+}
+
+/* Remove the free block from the tree. Chained blocks are removed in O(1). */
+static void tree_delete(word_t *block_ptr) {
+  word_t *prev = get_free_prev(block_ptr);
+  word_t *next = get_free_next(block_ptr);
+
+  /* The block is in a chain, just unlink it */
+  if (prev != NULL) {
+    tree_set(prev, TREE_NEXT, next);
+    if (next)
+      set_free_prev(next, prev);
+    return;
+  }
+
+  /* The block is a tree node with a chain, the next block takes its place */
+  if (next != NULL) {
+    word_t *left = tree_get(block_ptr, TREE_LEFT);
+    word_t *right = tree_get(block_ptr, TREE_RIGHT);
+    tree_set(next, TREE_PREV, NULL);
+    tree_set(next, TREE_LEFT, left);
+    tree_set(next, TREE_RIGHT, right);
+    next[TREE_PRIORITY] = block_ptr[TREE_PRIORITY];
+    if (left)
+      tree_set(left, TREE_PARENT, next);
+    if (right)
+      tree_set(right, TREE_PARENT, next);
+    tree_replace_child(block_ptr, next);
+    return;
+  }
+
+  /* Rotate the node down until it has at most one child, then splice it */
+  for (;;) {
+    word_t *left = tree_get(block_ptr, TREE_LEFT);
+    word_t *right = tree_get(block_ptr, TREE_RIGHT);
+    if (left == NULL || right == NULL) {
+      tree_replace_child(block_ptr, left ? left : right);
+      break;
+    }
+    if (tree_priority(left) > tree_priority(right))
+      tree_rotate_up(left);
+    else
+      tree_rotate_up(right);
+  }
+
+  if (arena->segregated_list[TREE_INDEX] == NULL)
+    bitmap_clr(TREE_INDEX);
+}
+
+/* True if the node can take the new size without leaving its place in the
+ * size order: it has no chain, and the size stays between the next smaller
+ * and the next larger node. Only the path to that neighbour is read. */
+static bool tree_keeps_place(word_t *node, size_t size) {
+  size_t old = bt_size(node);
+  if (get_free_next(node) || get_free_prev(node) || size == old)
+    return false;
+  /* The predecessor when it shrinks, the successor when it grows */
+  int side = size < old ? TREE_LEFT : TREE_RIGHT;
+  int other = size < old ? TREE_RIGHT : TREE_LEFT;
+  word_t *near = tree_get(node, side);
+  if (near) {
+    for (word_t *bt; (bt = tree_get(near, other)) != NULL;)
+      near = bt;
+  } else {
+    word_t *child = node;
+    while ((near = tree_get(child, TREE_PARENT)) != NULL &&
+           tree_get(near, side) == child)
+      child = near;
+  }
+  if (near == NULL)
+    return true;
+  return size < old ? size > bt_size(near) : size < bt_size(near);
+}
+
+/* Move the node to new, which takes its links and priority. The words of new
+ * may overlap those of the node, so they are read first. */
+static void tree_move(word_t *node, word_t *new) {
+  if (new == node)
+    return;
+  word_t *left = tree_get(node, TREE_LEFT);
+  word_t *right = tree_get(node, TREE_RIGHT);
+  word_t priority = node[TREE_PRIORITY];
+  tree_replace_child(node, new);
+  tree_set(new, TREE_NEXT, NULL);
+  tree_set(new, TREE_PREV, NULL);
+  tree_set(new, TREE_LEFT, left);
+  tree_set(new, TREE_RIGHT, right);
+  new[TREE_PRIORITY] = priority;
+  if (left)
+    tree_set(left, TREE_PARENT, new);
+  if (right)
+    tree_set(right, TREE_PARENT, new);
 }
 
-/* Add the new free block at the end of the free_list from segregated_list of
- * given index */
+/* Returns the smallest block in the tree with size >= asize or NULL.
+ * A chained block is preferred, because it is cheaper to remove. */
+static word_t *tree_find(size_t asize) {
+  word_t *best_fit = NULL;
+  word_t *node = arena->segregated_list[TREE_INDEX];
+
+  while (node != NULL) {
+    STAT(arena->stats->probes++);
+    if (bt_size(node) == asize) {
+      best_fit = node;
+      break;
+    }
+    if (bt_size(node) > asize) {
+      best_fit = node;
+      node = tree_get(node, TREE_LEFT);
+    } else {
+      node = tree_get(node, TREE_RIGHT);
+    }
+  }
+
+  if (best_fit && get_free_next(best_fit))
+    return get_free_next(best_fit);
+  return best_fit;
+}
+
+/* --=[ free list insertion and deletion ]=--------------------------------- */
+
+/* The first reserved block, or NULL */
+static inline word_t *reserved_list(void) {
+  return arena->optional ? arena->optional->reserved : NULL;
+}
+
+/* Add the new free block to the free_list from segregated_list of given index,
+ * at the front, or after the blocks at lower addresses with FREE_ADDRESS.
+ * Reserved blocks always go to their own bucket. */
 static inline void free_list_append(word_t *block_ptr, word_t index) {
-  /* Prev block will return NULL */
-  set_free_prev(block_ptr, heap_start - 1);
-  /* If free list is empty set prev block to NULL (the distance from the
-   * heap_start will be set to -1)*/
-  if (segregated_list[index] == NULL) {
-    set_free_next(block_ptr, heap_start - 1);
-  } else { /* else set prev and next block */
-    set_free_prev(segregated_list[index], block_ptr);
-    set_free_next(block_ptr, segregated_list[index]);
+  word_t **head = &arena->segregated_list[index];
+  if (*block_ptr & RESERVED) {
+    index = RESERVED_INDEX;
+    head = &arena->optional->reserved;
+  }
+  STAT(arena->stats->free_bytes[index] += bt_size(block_ptr));
+  if (index == TREE_INDEX) {
+    tree_insert(block_ptr);
+    return;
+  }
+  word_t *prev = NULL;
+  word_t *next = *head;
+  if (free_order == FREE_ADDRESS) {
+    while (next != NULL && next < block_ptr) {
+      prev = next;
+      next = get_free_next(next);
+    }
   }
-  /* It will be a new last block */
-  segregated_list[index] = block_ptr;
+  /* A missing neighbour is stored as NULL (the distance from the heap_start
+   * will be set to -1) */
+  set_free_prev(block_ptr, prev ? prev : arena->heap_start - 1);
+  set_free_next(block_ptr, next ? next : arena->heap_start - 1);
+  if (next)
+    set_free_prev(next, block_ptr);
+  if (prev)
+    set_free_next(prev, block_ptr);
+  else
+    *head = block_ptr;
+  bitmap_set(index);
 }
 
 /* Delete the block of the given address from the free_list from segregated_list
  * of given index */
 static inline void free_list_delete(word_t *block_ptr, word_t index) {
+  word_t **head = &arena->segregated_list[index];
+  if (*block_ptr & RESERVED) {
+    index = RESERVED_INDEX;
+    head = &arena->optional->reserved;
+  }
+  STAT(arena->stats->free_bytes[index] -= bt_size(block_ptr));
+  if (index == TREE_INDEX) {
+    tree_delete(block_ptr);
+    return;
+  }
+  /* Next fit goes on after the block */
+  if (arena->optional && arena->optional->rover == block_ptr)
+    arena->optional->rover = get_free_next(block_ptr);
   /* If the block was the only one on the list, the list will be empty now */
-  if (segregated_list[index] == block_ptr && get_free_next(block_ptr) == NULL) {
-    segregated_list[index] = NULL;
+  if (*head == block_ptr && get_free_next(block_ptr) == NULL) {
+    *head = NULL;
+    bitmap_clr(index);
     return;
   }
   /* If that was the first block of the list we set the next block as the new
    * beginning of the list */
-  if (segregated_list[index] == block_ptr) {
-    set_free_prev(get_free_next(block_ptr), heap_start - 1);
-    segregated_list[index] = get_free_next(block_ptr);
+  if (*head == block_ptr) {
+    set_free_prev(get_free_next(block_ptr), arena->heap_start - 1);
+    *head = get_free_next(block_ptr);
     return;
   }
   /* If we delete the block that is somewhere in the middle of the list, we need
    * to connect the previous block with the next one */
-  if (segregated_list[index] != block_ptr && get_free_next(block_ptr) != NULL) {
+  if (*head != block_ptr && get_free_next(block_ptr) != NULL) {
     set_free_next(get_free_prev(block_ptr), get_free_next(block_ptr));
     set_free_prev(get_free_next(block_ptr), get_free_prev(block_ptr));
     return;
   }
   /* else, the block was the last one, so we set the next block of the previous
    * one to NULL, and that block will be the new last block */
-  set_free_next(get_free_prev(block_ptr), heap_start - 1);
-  last_free = get_free_prev(block_ptr);
+  set_free_next(get_free_prev(block_ptr), arena->heap_start - 1);
 }
-/* --=[ segregated list ]=------------------------------------------ */
-
-#define NUM_LIST 9 /* Number of buckets */
 
-/* The following buckets consist of the following size of blocks (in the ranges:
- * e.g. 2 (segregated_list[2]) bucket are blocks in the range (32, 64] bytes*/
-/*
-#define SIZE0 16
-#define SIZE1 32
-#define SIZE2 64
-#define SIZE3 128
-#define SIZE4 256
-#define SIZE5 512
-#define SIZE6 1024
-#define SIZE7 2048
-#define SIZE8 4096*/
+/* True if the free block can become size bytes long without leaving its place
+ * on the free lists, which only a tree node can */
+static inline bool free_list_keeps(word_t *block_ptr, size_t size) {
+  return !(*block_ptr & RESERVED) &&
+         get_index(bt_size(block_ptr)) == TREE_INDEX &&
+         get_index(size) == TREE_INDEX && tree_keeps_place(block_ptr, size);
+}
 
-/* Binsearch to find the index of a list that contains blocks of a given size */
-static inline word_t get_index(size_t size) {
-  if (size <= 512) {
-    if (size <= 64) {
-      if (size == 16)
-        return 0;
-      if (size == 32)
-        return 1;
-      return 2;
-    } else if (size <= 256) {
-      if (size <= 128)
-        return 3;
-      return 4;
-    }
-    return 5;
-  }
-  if (size <= 2048) {
-    if (size <= 1024)
-      return 6;
-    return 7;
-  }
-  return 8;
+/* The free block of size bytes at new takes the place of the one at block_ptr,
+ * if free_list_keeps says it can, before either header is written */
+static inline void free_list_move(word_t *block_ptr, word_t *new, size_t size) {
+  STAT(arena->stats->free_bytes[TREE_INDEX] += size - bt_size(block_ptr));
+  tree_move(block_ptr, new);
 }
 
 /* --=[ init procedures ]=------------------------------------------ */
 
 static void place(word_t *bp, size_t asize);
-static word_t *extend_heap(size_t words);
+static word_t *extend_heap(size_t size, bool surplus);
 static word_t *find_fit(size_t asize);
 static word_t *coalesce(word_t *bp);
+static void free_block(word_t *block_ptr);
+static inline void free_heap(word_t *block_ptr);
+static word_t *quick_get(size_t asize);
+static bool quick_put(word_t *block_ptr);
+static bool quick_flush(void);
+#ifdef TRIM
+static void return_memory(void);
+#endif
+#ifdef SLAB
+static void *slab_malloc(size_t size);
+static int slab_owns(void *ptr);
+static void slab_free(void *ptr);
+static size_t slab_size(void *ptr);
+#endif
 
-/* --=[ mm_init - Called when a new trace starts. ]=--------------------*/
-/* Sets global values */
-int mm_init(void) {
-  /* initialize segregated list that consist 9 pointers */
-  if ((segregated_list = mem_sbrk(8 * NUM_LIST)) == (void *)-1)
-    return -1;
+/* --=[ arena_sbrk ]=------------------------------------------------------ */
+/* Extend (or shrink, if incr is negative) the arena by incr bytes, returns the
+ * start of the new area or -1. Arena 0 is extended with mem_sbrk, other arenas
+ * within their own region. */
+static void *arena_sbrk(long incr) {
+  void *old_brk;
+#ifdef THREADS
+  if (arena != main_arena) {
+    old_brk = arena->brk;
+    if (old_brk + incr > arena->max_addr)
+      return (void *)-1;
+    arena->brk = old_brk + incr;
+    if (incr < 0)
+      mem_release(arena->brk, -incr);
+  } else {
+    old_brk = mem_sbrk(incr);
+  }
+#else
+  old_brk = mem_sbrk(incr);
+#endif
+#ifdef BLOCK_MAP
+  /* The block map grows with the arena */
+  if (old_brk != (void *)-1 && incr > 0 && map_reserve(old_brk + incr) < 0) {
+    arena_sbrk(-incr);
+    return (void *)-1;
+  }
+#endif
+  return old_brk;
+}
+
+/* Start of the memory at the end of the arena that reads as zero. Arena
+ * regions keep what earlier runs wrote, so only arena 0 knows of any. */
+static inline void *arena_clean(void) {
+#ifdef THREADS
+  if (arena != main_arena)
+    return arena->max_addr;
+#endif
+  return mem_clean_lo();
+}
 
+/* Size of the arena header with extra bytes after it. It is padded so that
+ * the payloads after the prologue are aligned to ALIGNMENT */
+static inline size_t arena_header_size(size_t extra) {
+  return round_up(sizeof(arena_t) + extra + 8) - 8;
+}
+
+/* Point the arena at its optional state and quick lists, which follow its
+ * header and skip bytes of shared data */
+static inline void arena_place(size_t skip, size_t optional_size,
+                               size_t quick_size) {
+  void *end = (void *)arena + sizeof(arena_t) + skip;
+  arena->optional = optional_size ? end : NULL;
+  arena->quick = quick_size ? end + optional_size : NULL;
+}
+
+/* The blocks start after the prologue, which puts the payload of the first one
+ * on an ALIGNMENT boundary: 20 bytes = header + footer + 12 bytes of payload,
+ * or 16 bytes with 8-byte words */
+#define PROLOGUE_SIZE (ALIGNMENT + 8 - WSIZE)
+
+/* The arena, and brk for arena 0, ends this far past the epilogue header, 8
+ * bytes past an ALIGNMENT boundary */
+#define EPILOGUE_SIZE (2 * ALIGNMENT - PROLOGUE_SIZE)
+
+/* Create an empty heap in the arena, right after its header */
+static int arena_init(void) {
+  for (int i = 0; i < BITMAP_WORDS; i++) {
+    arena->nonempty[i] = 0;
+  }
   for (int i = 0; i < NUM_LIST; i++) {
-    segregated_list[i] = NULL;
+    arena->segregated_list[i] = NULL;
+  }
+#ifdef SLAB
+  memset(arena->slab_runs, -1, sizeof(arena->slab_runs));
+#endif
+  if (arena->quick != NULL) {
+    memset(arena->quick->head, -1, sizeof(arena->quick->head));
+    memset(arena->quick->len, 0, sizeof(arena->quick->len));
+  }
+  if (arena->optional != NULL) {
+    arena->optional->reserved = NULL;
+    arena->optional->rover = NULL;
   }
+  arena->grow = 0;
+#ifdef BLOCK_MAP
+  arena->map = NULL;
+  arena->map_len = 0;
+#endif
+#ifdef STATS
+  memset(arena->stats, 0, sizeof(*arena->stats));
+#endif
+#ifdef THREADS
+  pthread_mutex_init(&arena->lock, NULL);
+  arena->remote = NULL;
+#endif
 
-  if ((heap_start = (word_t *)mem_sbrk(2 * ALIGNMENT)) == (void *)-1)
+  if ((arena->heap_start = (word_t *)arena_sbrk(2 * ALIGNMENT)) == (void *)-1)
     return -1;
   /* Prologue and epilogue initialisation is from CSAPP book */
-  PUT(heap_start, 0); /* Alignment padding */
-  bt_make(
-    heap_start, 20,
-    USED); /* Prologue -> 20 bytes = header + footer + (12 bytes) payload */
+  PUT(arena->heap_start, 0); /* Alignment padding */
+  bt_make(arena->heap_start, PROLOGUE_SIZE, USED);
 
-  PUT(heap_start + 5, PACK(0, USED)); /* Epilogue header -> 4 bytes*/
+  /* Epilogue header */
+  PUT(arena->heap_start + PROLOGUE_SIZE / WSIZE, PACK(0, USED));
 
   /* Set global pointers */
-  heap_start += 5;
-  heap_end = heap_start;
-  last = NULL;
-
-  free_list_start = NULL;
-  last_free = NULL;
+  arena->heap_start += PROLOGUE_SIZE / WSIZE;
+  arena->heap_end = arena->heap_start;
+  arena->last = NULL;
+#ifdef TRIM
+  arena->dirty = 0;
+#endif
 
   return 0;
 }
 
-/* --=[ extend_heap]=------------------------------------------------------- */
-/* Extend heap by requested amount of bytes, if the mem_sbrk fails, return NULL,
- * else - create a new allocated block and the new epilog. */
-static word_t *extend_heap(size_t size) {
-  if ((long)(mem_sbrk(size)) == -1)
-    return NULL;
-
-  word_t *block_ptr = heap_end; /* We need to overwrite epilogue*/
-
-  /* If the last block was free, add it to the new allocated block */
-  if (last != NULL && bt_free(last)) {
-    block_ptr = last;
-    free_list_delete(block_ptr, get_index(bt_size(last)));
-    size += bt_size(last);
-  }
-  /* Create a new allocated block */
-  bt_make(block_ptr, size, USED);
+/* --=[ mm_init - Called when a new trace starts. ]=--------------------*/
+/* Sets global values */
+int mm_init(void) {
+  /* The header of arena 0 is followed by data shared by all arenas */
+  size_t shared_size = 0;
+#ifdef SLAB
+  shared_size += SLAB_PAGES / 8;
+#endif
+  /* ... and by the state of next fit and reservations and its quick lists,
+   * if any */
+  size_t optional_size =
+    fit_policy == FIT_NEXT || reserve_percent > 0 ? sizeof(optional_t) : 0;
+  size_t quick_size = quick_limit > 0 ? sizeof(quick_t) : 0;
+  size_t own_size = optional_size + quick_size;
+  if ((arena = mem_sbrk(arena_header_size(shared_size + own_size))) ==
+      (void *)-1)
+    return -1;
+  main_arena = arena;
+#ifdef SLAB
+  slab_pages = (void *)arena + sizeof(arena_t);
+  memset(slab_pages, 0, SLAB_PAGES / 8);
+#endif
+  arena_place(shared_size, optional_size, quick_size);
+
+#ifdef THREADS
+  /* Other arenas are reserved from the top of the heap, so arena 0 can keep
+   * growing with mem_sbrk */
+  if (NUM_ARENAS > 1) {
+    if ((arenas_lo = mem_reserve((NUM_ARENAS - 1) * ARENA_SIZE)) == (void *)-1)
+      return -1;
+    for (int i = 1; i < NUM_ARENAS; i++) {
+      arena = arenas_lo + (i - 1) * ARENA_SIZE;
+      arena->brk = (void *)arena + arena_header_size(own_size);
+      arena_place(0, optional_size, quick_size);
+      arena->max_addr = (void *)arena + ARENA_SIZE;
+      STAT(arena->stats = &arena_stats[i]);
+      if (arena_init() < 0)
+        return -1;
+    }
+    arena = main_arena;
+  }
+  home = NULL;
+  next_arena = 0;
+  pthread_once(&tcache_once, tcache_key_create);
+  tcache_drop();
+#endif
+
+  STAT(arena->stats = &arena_stats[0]);
+  return arena_init();
+}
+
+/* --=[ mapped blocks ]=--------------------------------------------------- */
+/* Requests of at least MMAP_THRESHOLD bytes get a mapping of their own, which
+ * is unmapped as soon as the block is freed, and resized with mem_remap.
+ * The first ALIGNMENT bytes of the mapping hold its length and the header of
+ * the block, with the MAPPED flag set and size 0. Mapped blocks never appear
+ * in an arena, so they can't pin fragmentation in the heap. */
+#ifndef MMAP_THRESHOLD
+#define MMAP_THRESHOLD (4 * (1 << 20))
+#endif
+
+static inline bool block_mapped(void *ptr) {
+#ifdef SLAB
+  /* Slab objects have no header */
+  if (slab_owns(ptr))
+    return false;
+#endif
+  /* Without the lock, like tcache_block_index */
+  return __atomic_load_n(bt_header(ptr), __ATOMIC_RELAXED) & MAPPED;
+}
+
+/* Returns the start of the mapping, where its length is stored */
+static inline size_t *mapping_of(void *ptr) {
+  return ptr - ALIGNMENT;
+}
+
+/* Length of the mapping for a block of size bytes, or 0 on overflow */
+static inline size_t mapping_length(size_t size) {
+  size_t page = mem_pagesize();
+  size_t len = (size + ALIGNMENT + page - 1) & -page;
+  return len > size ? len : 0;
+}
+
+static void *map_block(size_t size) {
+  size_t len = mapping_length(size);
+  size_t *start;
+
+  if (len == 0 || (start = mem_map(len)) == (void *)-1)
+    return NULL;
+  *start = len;
+  void *ptr = (void *)start + ALIGNMENT;
+  PUT(bt_header(ptr), PACK(0, USED | MAPPED));
+  return ptr;
+}
+
+static inline void unmap_block(void *ptr) {
+  mem_unmap(mapping_of(ptr));
+}
+
+/* Returns the new payload, or NULL if the old block is left untouched */
+static void *remap_block(void *ptr, size_t size) {
+  size_t len = mapping_length(size);
+  size_t *start = mapping_of(ptr);
+
+  if (len == *start)
+    return ptr;
+  if (len == 0 || (start = mem_remap(start, len)) == (void *)-1)
+    return NULL;
+  *start = len;
+  return (void *)start + ALIGNMENT;
+}
+
+/* --=[ extend_heap]=------------------------------------------------------- */
+/* Bytes to grow the heap by past a new block of size bytes, so that it ends 8
+ * bytes short of a huge page boundary when it is backed by huge pages. Those
+ * become a free block, unless there are too few of them. */
+static inline size_t grow_tail(size_t size) {
+  size_t step = mem_hugepagesize();
+  if (step == 0)
+    return 0;
+  uintptr_t brk = (uintptr_t)arena->heap_end + EPILOGUE_SIZE + size;
+  size_t tail = -(brk + 8) & (step - 1);
+  return tail >= MIN_BLOCK ? tail : 0;
+}
+
+/* With mm_grow_percent, a heap that keeps growing is extended by more than the
+ * miss needs, and the surplus becomes a free block at its end, so the next
+ * requests don't each call mem_sbrk. The surplus doubles with every extension,
+ * from GROW_MIN up to GROW_MAX bytes, but is never above mm_grow_percent of
+ * the heap, which keeps small heaps tight. A free that gives the end of the
+ * heap back halves it: the more often that happens between extensions, the
+ * less the heap is growing. */
+#ifndef GROW_PERCENT
+#define GROW_PERCENT 0 /* Off unless asked for, it costs utilization */
+#endif
+#ifndef GROW_MIN
+#define GROW_MIN 4096
+#endif
+#ifndef GROW_MAX
+#define GROW_MAX (1 << 20)
+#endif
+
+static int grow_percent = GROW_PERCENT;
+
+int mm_grow_percent(int percent) {
+  int old = grow_percent;
+  if (percent >= 0)
+    grow_percent = percent;
+  return old;
+}
+
+/* Bytes to extend the heap by past what the current miss needs */
+static inline size_t grow_surplus(void) {
+  size_t heap = (void *)arena->heap_end - (void *)arena->heap_start;
+  size_t cap = heap / 100 * grow_percent;
+  size_t surplus = arena->grow < cap ? arena->grow : cap;
+
+  arena->grow = arena->grow ? 2 * arena->grow : GROW_MIN;
+  if (arena->grow > GROW_MAX)
+    arena->grow = GROW_MAX;
+  surplus &= -ALIGNMENT;
+  return surplus >= MIN_BLOCK ? surplus : 0;
+}
+
+/* Extend heap by requested amount of bytes, if the mem_sbrk fails, return NULL,
+ * else - create a new allocated block and the new epilog. A block that realloc
+ * grows at the end of the heap gets no surplus, the next mallocs would take it
+ * and make the block move. */
+static word_t *extend_heap(size_t size, bool surplus) {
+  size_t tail = surplus ? grow_surplus() : 0;
+  tail += grow_tail(size + tail);
+  if (tail > 0 && (long)(arena_sbrk(size + tail)) == -1)
+    tail = 0;
+  if (tail == 0 && (long)(arena_sbrk(size)) == -1)
+    return NULL;
+  STAT(arena->stats->extends++);
+  STAT(arena->stats->extend_bytes += size + tail);
+
+  word_t *block_ptr = arena->heap_end; /* We need to overwrite epilogue*/
+
+  /* If the last block was free, add it to the new allocated block */
+  if (arena->last != NULL && bt_free(arena->last)) {
+    block_ptr = arena->last;
+    free_list_delete(block_ptr, get_index(bt_size(arena->last)));
+    size += bt_size(arena->last);
+  }
+  /* Create a new allocated block */
+  bt_make(block_ptr, size, USED);
 
   PUT(((void *)block_ptr + size), PACK(0, USED)); /* New epilogue header */
 
-  last = block_ptr; /* Pointer to the last block */
+  arena->last = block_ptr; /* Pointer to the last block */
 
-  heap_end = (void *)block_ptr + size; /* Pointer to the new epilogue*/
+  arena->heap_end = (void *)block_ptr + size; /* Pointer to the new epilogue*/
+
+  /* The surplus and the rest of the huge page are free */
+  if (tail > 0) {
+    word_t *rest = arena->heap_end;
+    arena->heap_end = (void *)rest + tail;
+    PUT(arena->heap_end, PACK(0, USED));
+    bt_make(rest, tail, FREE);
+    free_list_append(rest, get_index(tail));
+    arena->last = rest;
+  }
 
   return block_ptr;
 }
 
 /* --=[ malloc ]=----------------------------------------------------------- */
+/* The part of a new block that is known to read as zero, see calloc */
+typedef struct {
+  void *lo, *hi;
+} zero_t;
+
+static void *alloc(size_t size, zero_t *zero);
+
+/* Free blocks keep their boundary tags and links in the first LINKS_SIZE bytes
+ * and the last word, the pages in between can be released (see TRIM) */
+#define LINKS_SIZE ((TREE_PRIORITY + 1) * WSIZE)
+
+static inline zero_t released_part(word_t *block_ptr) {
+  size_t page = mem_heap_pagesize();
+  uintptr_t lo = ((uintptr_t)block_ptr + LINKS_SIZE + page - 1) & -page;
+  uintptr_t hi = (uintptr_t)bt_footer(block_ptr) & -page;
+  return (zero_t){(void *)lo, (void *)hi};
+}
+
+void *malloc(size_t size) {
+  return alloc(size, NULL);
+}
+
 /* Search for a suitable free block, and place the new allocated block. If there
- * is no proper free block size - extend heap.
+ * is no proper free block size - extend heap. If zero is not NULL, it is set to
+ * the part of the block that reads as zero.
  * return a pointer to the payload */
-void *malloc(size_t size) {
+static inline void *alloc(size_t size, zero_t *zero) {
   size_t asize; /* Adjusted block size */
   word_t *block_ptr;
+  void *ptr;
 
   /* Ignore spurious requests */
   if (size == 0)
     return NULL;
 
+  /* Huge requests are mapped directly */
+  if (size >= MMAP_THRESHOLD && (ptr = map_block(size)) != NULL) {
+    if (zero)
+      *zero = (zero_t){ptr, ptr + size};
+    return ptr;
+  }
+
   /* Adjust block size to include header and alignment reqs. */
-  asize = round_up(size + WSIZE);
+  asize = block_size(size);
+  STAT(arena->stats->mallocs[get_index(asize)]++);
+
+#ifdef SLAB
+  /* Small requests are served from runs */
+  if (size <= SLAB_MAX)
+    return slab_malloc(size);
+#endif
+
+  if ((block_ptr = quick_get(asize)) != NULL)
+    return (void *)bt_payload(block_ptr);
 
   /* If there is a suitable block, place a new block there and return a pointer
    * to the payload */
   if ((block_ptr = find_fit(asize)) != NULL) {
+    if (zero && (*block_ptr & RELEASED))
+      *zero = released_part(block_ptr);
     place(block_ptr, asize);
     return (void *)bt_payload(block_ptr);
   }
@@ -409,12 +1424,22 @@ void *malloc(size_t size) {
 
   /* If the last block is free, we can extend heap by smaller amount of
    * bytes, and place the new block in place of this free block */
-  if (last != NULL && bt_free(last))
-    extend_size -= bt_size(last);
+  if (arena->last != NULL && bt_free(arena->last))
+    extend_size -= bt_size(arena->last);
+
+  /* Memory past the old epilogue that was never written reads as zero */
+  void *fresh = (void *)arena->heap_end + WSIZE;
+  if (zero) {
+    void *clean = arena_clean();
+    if (clean > fresh)
+      fresh = clean;
+  }
 
   /* If extend_heap fails, return NULL */
-  if ((block_ptr = extend_heap(extend_size)) == NULL)
+  if ((block_ptr = extend_heap(extend_size, true)) == NULL)
     return NULL;
+  if (zero)
+    *zero = (zero_t){fresh, arena->heap_end};
   /* extend_heap returned a pointer to the new allocated block*/
   return (void *)bt_payload(block_ptr);
 }
@@ -424,54 +1449,143 @@ void *malloc(size_t size) {
 static void place(word_t *block_ptr, size_t asize) {
   /* size of the selected free block */
   size_t fsize = bt_size(block_ptr);
-
-  /* We need to delete the free block t=from the list of free blocks */
-  free_list_delete(block_ptr, get_index(fsize));
+  bool released = *block_ptr & RELEASED;
+  word_t *rest = (void *)block_ptr + asize;
+  size_t rest_size = fsize - asize;
+
+  /* A large rest can often take the place of the block in the tree, otherwise
+   * we need to delete the free block from the list of free blocks */
+  bool keep = rest_size >= MIN_BLOCK && free_list_keeps(block_ptr, rest_size);
+  if (keep)
+    free_list_move(block_ptr, rest, rest_size);
+  else
+    free_list_delete(block_ptr, get_index(fsize));
 
   /* split the block into allocated and free
    if the new free block satisfies the alignment */
-  if ((fsize - asize) >= ALIGNMENT) {
+  if (rest_size >= MIN_BLOCK) {
+    STAT(arena->stats->splits++);
     bt_make(block_ptr, asize, USED | bt_get_prevfree(block_ptr));
-    block_ptr = bt_next(block_ptr);
-    bt_make(block_ptr, fsize - asize, FREE);
-    free_list_append(block_ptr, get_index(fsize - asize));
+    /* The released pages of the rest are still untouched */
+    bt_make(rest, rest_size, FREE | (released ? RELEASED : 0));
+    if (!keep)
+      free_list_append(rest, get_index(rest_size));
     /* If we changed the last block, the new free block will be the new last
      * block */
-    if (last < block_ptr)
-      last = block_ptr;
+    if (arena->last < rest)
+      arena->last = rest;
   } else {
     /* internal fragmentation
-    because we can't create free block with size < ALIGNMENT*/
+    because we can't create free block with size < MIN_BLOCK*/
     bt_make(block_ptr, fsize, USED | bt_get_prevfree(block_ptr));
   }
 }
 
 /* --=[ find fit]=----------------------------------------------------------- */
-/* First fit in segregated list - find free block that is suitable for the new
- * block that will be allocated */
-static word_t *find_fit(size_t asize) {
+#ifdef STATS
+/* Update the longest search, which started at the given probe count */
+static inline void count_probes(uint64_t first_probe) {
+  uint64_t probes = arena->stats->probes - first_probe;
+  if (probes > arena->stats->max_probes)
+    arena->stats->max_probes = probes;
+}
+#endif
 
-  /* Best fit search */
-  // word_t *ptr;
-  word_t *best_fit = NULL;
-  word_t index = get_index(asize);
-  while (index < NUM_LIST) {
-    for (word_t *ptr = segregated_list[index]; ptr != NULL;
-         ptr = get_free_next(ptr)) {
-      if (bt_size(ptr) >= asize) {
-        if (best_fit == NULL || bt_size(ptr) < bt_size(best_fit)) {
-          best_fit = ptr;
-        }
+int mm_fit_policy(int policy) {
+  int old = fit_policy;
+  if (policy >= 0)
+    fit_policy = policy;
+  return old;
+}
+
+int mm_free_order(int order) {
+  int old = free_order;
+  if (order >= 0)
+    free_order = order;
+  return old;
+}
+
+/* The block of the bucket that the placement policy takes for asize bytes, or
+ * NULL if none is large enough. Next fit goes around the list from the rover,
+ * the others look at it from the front. */
+static inline word_t *list_fit(word_t index, size_t asize) {
+  word_t *head = arena->segregated_list[index];
+  word_t *start = head;
+  word_t *fit = NULL;
+  int probes = 0;
+
+  optional_t *opt = fit_policy == FIT_NEXT ? arena->optional : NULL;
+  if (opt && opt->rover && opt->rover_index == index)
+    start = opt->rover;
+
+  word_t *ptr = start;
+  do {
+    STAT(arena->stats->probes++);
+    size_t size = bt_size(ptr);
+    if (size >= asize) {
+      if (fit_policy == FIT_FIRST || fit_policy == FIT_NEXT) {
+        fit = ptr;
+        break;
       }
+      if (fit == NULL || size < bt_size(fit))
+        fit = ptr;
+      /* The first exact fit is the best one */
+      if (size == asize)
+        break;
     }
-    if (best_fit != NULL) {
+    if (fit_policy == FIT_GOOD && fit != NULL &&
+        (++probes >= GOOD_FIT_PROBES ||
+         (bt_size(fit) - asize) * 100 <= asize * GOOD_FIT_SLACK))
+      break;
+    if ((ptr = get_free_next(ptr)) == NULL)
+      ptr = head;
+  } while (ptr != start);
+
+  if (opt && fit) {
+    opt->rover = fit;
+    opt->rover_index = index;
+  }
+  return fit;
+}
+
+/* Find a free block that is suitable for the new block that will be allocated,
+ * with the placement policy. Empty buckets are skipped using the bitmap. */
+static word_t *find_fit(size_t asize) {
+  STAT(arena->stats->fits++);
+  STAT(uint64_t first_probe = arena->stats->probes);
+
+  word_t *best_fit = NULL;
+  word_t index = bitmap_find(get_index(asize));
+  while (index < TREE_INDEX) {
+    if ((best_fit = list_fit(index, asize)) != NULL) {
+      STAT(count_probes(first_probe));
       return best_fit;
     }
 
-    index++;
+    index = bitmap_find(index + 1);
   }
 
-  return NULL;
+  /* The large blocks are kept in a size-ordered tree */
+  if (index == TREE_INDEX && (best_fit = tree_find(asize)) != NULL) {
+    STAT(count_probes(first_probe));
+    return best_fit;
+  }
+
+  /* Soft reservations are given away only when nothing else fits */
+  for (word_t *ptr = reserved_list(); ptr != NULL; ptr = get_free_next(ptr)) {
+    STAT(arena->stats->probes++);
+    if (bt_size(ptr) >= asize) {
+      if (best_fit == NULL || bt_size(ptr) < bt_size(best_fit)) {
+        best_fit = ptr;
+      }
+    }
+  }
+  STAT(count_probes(first_probe));
+
+  /* The blocks on the quick lists may coalesce into one that fits */
+  if (best_fit == NULL && quick_flush())
+    return find_fit(asize);
+  return best_fit;
 }
 
 /* --=[ free ]=------------------------------------------------------------- */
@@ -482,9 +1596,82 @@ void free(void *ptr) {
   if (ptr == NULL)
     return;
 
+#ifdef SLAB
+  if (slab_owns(ptr)) {
+    slab_free(ptr);
+    return;
+  }
+#endif
+
+  if (block_mapped(ptr)) {
+    unmap_block(ptr);
+    return;
+  }
+
   /* The argument is a pointer to the payload, so we need to get pointer to the
    * header */
-  word_t *block_ptr = bt_header(ptr);
+  free_heap(bt_header(ptr));
+}
+
+/* Like free, with the size the block was allocated with. Only requests of up
+ * to SLAB_MAX bytes get slab objects, and only those of MMAP_THRESHOLD bytes
+ * and more mapped blocks, so the size saves looking for most blocks. The
+ * bucket still comes from the header: coalesce needs it anyway, and place may
+ * have handed out more than the size asked for. A wrong size would free the
+ * block as the wrong kind, so unless NDEBUG is defined it is checked. */
+void free_sized(void *ptr, size_t size) {
+  if (ptr == NULL)
+    return;
+  assert(size <= malloc_usable_size(ptr));
+
+#ifdef SLAB
+  if (size <= SLAB_MAX && slab_owns(ptr)) {
+    slab_free(ptr);
+    return;
+  }
+#endif
+
+  if (size >= MMAP_THRESHOLD && block_mapped(ptr)) {
+    unmap_block(ptr);
+    return;
+  }
+
+  free_heap(bt_header(ptr));
+}
+
+/* Free a used block of the heap, or put it on a quick list */
+static inline void free_heap(word_t *block_ptr) {
+  if (quick_put(block_ptr))
+    return;
+  free_block(block_ptr);
+
+#ifdef TRIM
+  return_memory();
+#endif
+}
+
+/* Returns the number of bytes of the block that the caller may use, which
+ * round_up and place make more than were asked for. Other threads may flip the
+ * PREVFREE bit of the header at the same time, never the size. */
+size_t malloc_usable_size(void *ptr) {
+  if (ptr == NULL)
+    return 0;
+#ifdef SLAB
+  if (slab_owns(ptr))
+    return slab_size(ptr);
+#endif
+  if (block_mapped(ptr))
+    return *mapping_of(ptr) - ALIGNMENT;
+  word_t header = __atomic_load_n(bt_header(ptr), __ATOMIC_RELAXED);
+  return bt_size(&header) - WSIZE;
+}
+
+/* Turn a used block into a free one */
+static void free_block(word_t *block_ptr) {
+  MAP(map_verify(block_ptr, true, "freed block"));
+#ifdef TRIM
+  arena->dirty += bt_size(block_ptr);
+#endif
   /* We need to get the prevfree flag of an allocated block we want to free, to
    * know if we can coalesce the previous block with the new free block */
   bt_make(block_ptr, bt_size(block_ptr), FREE | bt_get_prevfree(block_ptr));
@@ -497,47 +1684,558 @@ void free(void *ptr) {
   }
 }
 
+/* --=[ quick lists ]=------------------------------------------------------ */
+/* The lists are linked through the first payload word, like the free lists */
+int mm_quick_limit(int limit) {
+  int old = quick_limit;
+  if (limit >= 0)
+    quick_limit = limit;
+  return old;
+}
+
+/* Take a block of exactly asize bytes off its quick list */
+static word_t *quick_get(size_t asize) {
+  if (asize > QUICK_MAX)
+    return NULL;
+  int i = asize / ALIGNMENT - 1;
+  if (arena->quick == NULL || arena->quick->head[i] < 0)
+    return NULL;
+
+  word_t *block_ptr = arena->heap_start + arena->quick->head[i];
+  arena->quick->head[i] = *(block_ptr + 1);
+  arena->quick->len[i]--;
+  STAT(arena->stats->quick_hits++);
+  return block_ptr;
+}
+
+/* Put a used block on its quick list, if it is small enough. Blocks grown by
+ * realloc are not, since they may have a reservation behind them. */
+static bool quick_put(word_t *block_ptr) {
+  size_t size = bt_size(block_ptr);
+  if (quick_limit == 0 || arena->quick == NULL || size > QUICK_MAX ||
+      (*block_ptr & GROWN))
+    return false;
+
+  int i = size / ALIGNMENT - 1;
+  *(block_ptr + 1) = arena->quick->head[i];
+  arena->quick->head[i] = block_ptr - arena->heap_start;
+  if (++arena->quick->len[i] > quick_limit)
+    quick_flush();
+  return true;
+}
+
+/* Free and coalesce all the blocks on the quick lists, return false if there
+ * were none */
+static bool quick_flush(void) {
+  bool flushed = false;
+
+  if (arena->quick == NULL)
+    return false;
+  for (int i = 0; i < QUICK_CLASSES; i++) {
+    while (arena->quick->head[i] >= 0) {
+      word_t *block_ptr = arena->heap_start + arena->quick->head[i];
+      arena->quick->head[i] = *(block_ptr + 1);
+      free_block(block_ptr);
+      flushed = true;
+    }
+    arena->quick->len[i] = 0;
+  }
+  STAT(arena->stats->quick_flushes += flushed);
+  return flushed;
+}
+
 /* --=[ coalesce ]=---------------------------------------------------------- */
 /* If there is another free block to the right or to the left of the new one,
  * coalesce them */
 static word_t *coalesce(word_t *block_ptr) {
 
-  word_t *prev_block = bt_prev(block_ptr);
   word_t *next_block = bt_next(block_ptr);
   word_t size = bt_size(block_ptr);
 
   int prev_free = bt_get_prevfree(block_ptr);
   int next_free = bt_free(next_block);
 
+  /* The footer of the previous block exists only if it is free */
+  word_t *prev_block = prev_free ? bt_prev(block_ptr) : NULL;
+  MAP(map_verify(next_block, !next_free, "next block"));
+  MAP(map_verify(prev_block, false, "previous block"));
+
   /* Check if there is need to change the pointer to the last block */
-  int change_last = (block_ptr == last || (next_block == last && next_free));
+  int change_last = (block_ptr == arena->last ||
+                     (next_block == arena->last && next_free));
 
-  if (next_free) {
+  STAT(prev_free && next_free ? arena->stats->coalesce_both++
+       : prev_free            ? arena->stats->coalesce_prev++
+                              : arena->stats->coalesce_next++);
+
+  word_t *start = prev_free ? prev_block : block_ptr;
+  if (next_free)
     size += bt_size(next_block);
-    free_list_delete(next_block, get_index(bt_size(next_block)));
+  if (prev_free)
+    size += bt_size(prev_block);
+
+  /* A neighbour in the tree can often stay in its place with the new size,
+   * the previous one first, which does not even move */
+  word_t *kept = NULL;
+  if (prev_free && free_list_keeps(prev_block, size))
+    kept = prev_block;
+  else if (next_free && free_list_keeps(next_block, size))
+    kept = next_block;
+
+  if (next_free) {
+    if (kept != next_block)
+      free_list_delete(next_block, get_index(bt_size(next_block)));
+    MAP(map_absorb(next_block));
   }
 
   if (prev_free) {
-    size += bt_size(prev_block);
-    block_ptr = prev_block;
-    free_list_delete(block_ptr, get_index(bt_size(block_ptr)));
+    MAP(map_absorb(block_ptr));
+    if (kept != prev_block)
+      free_list_delete(prev_block, get_index(bt_size(prev_block)));
   }
 
+  block_ptr = start;
+  if (kept)
+    free_list_move(kept, block_ptr, size);
   bt_make(block_ptr, size, FREE);
-  free_list_append(block_ptr, get_index(size));
+  if (kept == NULL)
+    free_list_append(block_ptr, get_index(size));
 
-  if (change_last)
-    last = block_ptr;
+  /* The end of the heap is given back, so it grows less the next time */
+  if (change_last) {
+    arena->last = block_ptr;
+    arena->grow /= 2;
+  }
 
   return block_ptr;
 }
 
+#ifdef TRIM
+/* --=[ returning memory ]=------------------------------------------------- */
+/* When the last block is free and at least TRIM_THRESHOLD bytes long, the heap
+ * is shrunk, so that TRIM_PAD bytes of the block are left. The gap between the
+ * two keeps a heap whose size oscillates from calling mem_sbrk on every free.
+ *
+ * Free blocks inside the heap of at least RELEASE_THRESHOLD bytes have their
+ * pages given back to the OS (a released page reads as zero when touched
+ * again). This is done once per RELEASE_INTERVAL bytes freed in the arena, so
+ * blocks that are reused soon after they were freed are never released. */
+#ifndef TRIM_THRESHOLD
+#define TRIM_THRESHOLD (256 * 1024)
+#endif
+#ifndef TRIM_PAD
+#define TRIM_PAD (128 * 1024)
+#endif
+#ifndef RELEASE_THRESHOLD
+#define RELEASE_THRESHOLD (256 * 1024)
+#endif
+#ifndef RELEASE_INTERVAL
+#define RELEASE_INTERVAL (16 * (1 << 20))
+#endif
+
+/* Cut the heap at the end of the last block, which is free */
+static void trim_heap(void) {
+  word_t *last = arena->last;
+  size_t size = bt_size(last);
+  size_t cut = (size - TRIM_PAD) & -ALIGNMENT;
+
+  /* A heap backed by huge pages keeps ending next to a huge page boundary */
+  size_t step = mem_hugepagesize();
+  if (step) {
+    uintptr_t brk = (uintptr_t)arena->heap_end + EPILOGUE_SIZE;
+    cut = brk - (((brk - cut + 8 + step - 1) & -step) - 8);
+  }
+
+  if (cut == 0 || (long)arena_sbrk(-(long)cut) == -1)
+    return;
+
+  free_list_delete(last, get_index(size));
+  arena->heap_end = (void *)arena->heap_end - cut;
+  PUT(arena->heap_end, PACK(0, USED)); /* New epilogue header */
+  bt_make(last, size - cut, FREE);
+  free_list_append(last, get_index(size - cut));
+}
+
+/* Release the pages of a free block, except for its boundary tags and links.
+ * The block is marked, so it is not released again and calloc knows that the
+ * pages read as zero. */
+static inline void release_block(word_t *block_ptr) {
+  if (*block_ptr & RELEASED)
+    return;
+  if (mem_release((void *)block_ptr + LINKS_SIZE,
+                  bt_size(block_ptr) - LINKS_SIZE - WSIZE) > 0) {
+    *block_ptr |= RELEASED;
+    *bt_footer(block_ptr) |= RELEASED;
+  }
+}
+
+/* Release the blocks of the subtree, large enough to be worth it. The bigger
+ * blocks are on the right. */
+static void release_tree(word_t *node) {
+  while (node != NULL) {
+    if (bt_size(node) >= RELEASE_THRESHOLD) {
+      release_tree(tree_get(node, TREE_LEFT));
+      for (word_t *ptr = node; ptr != NULL; ptr = get_free_next(ptr))
+        release_block(ptr);
+    }
+    node = tree_get(node, TREE_RIGHT);
+  }
+}
+
+/* Called after every free */
+static void return_memory(void) {
+  if (arena->last != NULL && bt_free(arena->last) &&
+      bt_size(arena->last) >= TRIM_THRESHOLD)
+    trim_heap();
+
+  if (arena->dirty < RELEASE_INTERVAL)
+    return;
+  arena->dirty = 0;
+
+  for (word_t index = bitmap_find(get_index(RELEASE_THRESHOLD));
+       index < TREE_INDEX; index = bitmap_find(index + 1)) {
+    for (word_t *ptr = arena->segregated_list[index]; ptr != NULL;
+         ptr = get_free_next(ptr)) {
+      if (bt_size(ptr) >= RELEASE_THRESHOLD)
+        release_block(ptr);
+    }
+  }
+  release_tree(arena->segregated_list[TREE_INDEX]);
+}
+#endif /* TRIM */
+
+/* --=[ aligned blocks ]=-------------------------------------------------- */
+/* Allocate a block of asize bytes, whose payload is aligned to align bytes
+ * (a power of two, bigger than ALIGNMENT). The free space before the block is
+ * split off as a separate free block. Returns the block or NULL. */
+/* Bytes before the payload of the free block to the next aligned payload, far
+ * enough for a free block to fit in between */
+static inline size_t aligned_gap(word_t *block_ptr, size_t align) {
+  size_t gap = (-(uintptr_t)bt_payload(block_ptr)) & (align - 1);
+  return gap > 0 && gap < MIN_BLOCK ? gap + align : gap;
+}
+
+/* The largest gap of any block */
+#define MAX_ALIGNED_GAP(align) \
+  ((align) - ALIGNMENT + 2 * (MIN_BLOCK - ALIGNMENT))
+
+/* Best fit among the blocks where an aligned block of asize bytes fits, so a
+ * block is taken as it is, if it's already aligned. Only the first
+ * ALIGNED_PROBES blocks of each bucket are looked at: gaps left by earlier
+ * aligned blocks pile up in the small buckets, and hardly ever fit. Large
+ * blocks are taken from the tree by the worst case of the gap. */
+#ifndef ALIGNED_PROBES
+#define ALIGNED_PROBES 32
+#endif
+
+static word_t *find_aligned_fit(size_t asize, size_t align) {
+  STAT(arena->stats->fits++);
+  STAT(uint64_t first_probe = arena->stats->probes);
+
+  word_t *best_fit = NULL;
+  size_t best_left = 0;
+  word_t index = bitmap_find(get_index(asize));
+  while (index < TREE_INDEX) {
+    int probes = 0;
+    for (word_t *ptr = arena->segregated_list[index];
+         ptr != NULL && probes < ALIGNED_PROBES;
+         ptr = get_free_next(ptr), probes++) {
+      STAT(arena->stats->probes++);
+      size_t need = asize + aligned_gap(ptr, align);
+      if (bt_size(ptr) >= need &&
+          (best_fit == NULL || bt_size(ptr) - need < best_left)) {
+        best_fit = ptr;
+        best_left = bt_size(ptr) - need;
+      }
+    }
+    if (best_fit != NULL) {
+      STAT(count_probes(first_probe));
+      return best_fit;
+    }
+    index = bitmap_find(index + 1);
+  }
+
+  if (index == TREE_INDEX &&
+      (best_fit = tree_find(asize + MAX_ALIGNED_GAP(align))) != NULL) {
+    STAT(count_probes(first_probe));
+    return best_fit;
+  }
+
+  for (word_t *ptr = reserved_list(); ptr != NULL; ptr = get_free_next(ptr)) {
+    STAT(arena->stats->probes++);
+    size_t need = asize + aligned_gap(ptr, align);
+    if (bt_size(ptr) >= need &&
+        (best_fit == NULL || bt_size(ptr) - need < best_left)) {
+      best_fit = ptr;
+      best_left = bt_size(ptr) - need;
+    }
+  }
+  STAT(count_probes(first_probe));
+
+  if (best_fit == NULL && quick_flush())
+    return find_aligned_fit(asize, align);
+  return best_fit;
+}
+
+static word_t *alloc_aligned(size_t asize, size_t align) {
+  word_t *block_ptr = find_aligned_fit(asize, align);
+  word_t *start;
+  size_t fsize, gap;
+
+  if (block_ptr != NULL) {
+    start = block_ptr;
+    fsize = bt_size(start);
+    free_list_delete(start, get_index(fsize));
+    gap = aligned_gap(start, align);
+  } else {
+    /* No fit found. Extend heap, so that there is enough space after the last
+     * free block (or the epilogue) for the aligned block */
+    start = arena->heap_end;
+    if (arena->last != NULL && bt_free(arena->last)) {
+      start = arena->last;
+      free_list_delete(start, get_index(bt_size(start)));
+    }
+    gap = aligned_gap(start, align);
+    fsize = gap + asize;
+    if ((void *)start + fsize > (void *)arena->heap_end) {
+      size_t incr = (void *)start + fsize - (void *)arena->heap_end;
+      if ((long)arena_sbrk(incr) == -1) {
+        if (start != arena->heap_end)
+          free_list_append(start, get_index(bt_size(start)));
+        return NULL;
+      }
+      STAT(arena->stats->extends++);
+      STAT(arena->stats->extend_bytes += incr);
+      /* New epilogue header */
+      arena->heap_end = (void *)start + fsize;
+      PUT(arena->heap_end, PACK(0, USED));
+    } else {
+      fsize = (void *)arena->heap_end - (void *)start;
+    }
+    arena->last = start;
+  }
+
+  bt_flags prevfree = bt_get_prevfree(start);
+  block_ptr = (void *)start + gap;
+  fsize -= gap;
+
+  /* Split the free space before the aligned block */
+  if (gap > 0) {
+    bt_make(start, gap, FREE);
+    free_list_append(start, get_index(gap));
+    prevfree = PREVFREE;
+  }
+
+  /* and after the aligned block, if it's possible */
+  if (fsize - asize >= MIN_BLOCK) {
+    bt_make(block_ptr, asize, USED | prevfree);
+    word_t *next = bt_next(block_ptr);
+    bt_make(next, fsize - asize, FREE);
+    free_list_append(next, get_index(fsize - asize));
+    if (arena->last < next)
+      arena->last = next;
+  } else {
+    bt_make(block_ptr, fsize, USED | prevfree);
+  }
+
+  if (arena->last < block_ptr)
+    arena->last = block_ptr;
+
+  return block_ptr;
+}
+
+/* --=[ memalign ]=-------------------------------------------------------- */
+/* Payloads aligned to more than ALIGNMENT bytes always come from the heap,
+ * slab objects and mappings are aligned to ALIGNMENT only */
+void *memalign(size_t alignment, size_t size) {
+  if (alignment & (alignment - 1))
+    return NULL;
+  if (alignment <= ALIGNMENT)
+    return malloc(size);
+  if (size == 0 || size > MAX_HEAP || alignment > MAX_HEAP)
+    return NULL;
+
+  size_t asize = block_size(size);
+  STAT(arena->stats->mallocs[get_index(asize)]++);
+
+  word_t *block_ptr = alloc_aligned(asize, alignment);
+  return block_ptr ? bt_payload(block_ptr) : NULL;
+}
+
+#ifdef SLAB
+/* --=[ slab runs ]=-------------------------------------------------------- */
+static inline run_t *run_of(void *ptr) {
+  return (run_t *)((uintptr_t)ptr & ~(uintptr_t)(RUN_SIZE - 1));
+}
+
+/* Page number of the run; the header of arena 0 is the first thing
+ * allocated by mm_init, so it marks the beginning of the heap */
+static inline size_t run_page(run_t *run) {
+  return ((void *)run - (void *)main_arena) / RUN_SIZE;
+}
+
+static inline run_t *run_get(word_t offset) {
+  if (offset < 0)
+    return NULL;
+
+  return (run_t *)(arena->heap_start + offset);
+}
+
+static inline word_t run_offset(run_t *run) {
+  return run ? (word_t)((word_t *)run - arena->heap_start) : -1;
+}
+
+/* Add the run at the front of the list of runs with free objects */
+static inline void run_push(run_t *run) {
+  word_t index = run->size / ALIGNMENT - 1;
+  run_t *head = run_get(arena->slab_runs[index]);
+  run->prev = -1;
+  run->next = run_offset(head);
+  if (head)
+    head->prev = run_offset(run);
+  arena->slab_runs[index] = run_offset(run);
+}
+
+/* Remove the run from the list of runs with free objects */
+static inline void run_remove(run_t *run) {
+  word_t index = run->size / ALIGNMENT - 1;
+  run_t *prev = run_get(run->prev);
+  run_t *next = run_get(run->next);
+  if (prev)
+    prev->next = run->next;
+  else
+    arena->slab_runs[index] = run->next;
+  if (next)
+    next->prev = run->prev;
+}
+
+/* Returns true if ptr points to an object in a run */
+static int slab_owns(void *ptr) {
+  size_t page = run_page(run_of(ptr));
+  if (page >= SLAB_PAGES) /* Outside of the heap, e.g. a mapped block */
+    return 0;
+  uint64_t bits = __atomic_load_n(&slab_pages[page / 64], __ATOMIC_RELAXED);
+  return (bits >> (page % 64)) & 1;
+}
+
+/* Returns the size of the object */
+static size_t slab_size(void *ptr) {
+  return run_of(ptr)->size;
+}
+
+/* Take an object from a run of the right size class, create a new run if
+ * every run of this class is full. */
+static void *slab_malloc(size_t size) {
+  size = round_up(size);
+  word_t index = size / ALIGNMENT - 1;
+  run_t *run = run_get(arena->slab_runs[index]);
+
+  if (run == NULL) {
+    word_t *block_ptr = alloc_aligned(RUN_SIZE, RUN_SIZE);
+    if (block_ptr == NULL)
+      return NULL;
+    run = bt_payload(block_ptr);
+    run->size = size;
+    run->nused = 0;
+    run->free = 0;
+    run->bump = round_up(sizeof(run_t));
+    size_t page = run_page(run);
+    /* Runs of other arenas may share the word */
+    __atomic_fetch_or(&slab_pages[page / 64], 1UL << (page % 64),
+                      __ATOMIC_RELAXED);
+    run_push(run);
+  }
+
+  void *ptr;
+  if (run->free) {
+    ptr = (void *)run + run->free;
+    run->free = *(uint16_t *)ptr;
+  } else {
+    ptr = (void *)run + run->bump;
+    run->bump += size;
+  }
+  run->nused++;
+
+  /* Full runs are not kept on the list */
+  if (run->free == 0 && run->bump + size > RUN_SIZE - WSIZE)
+    run_remove(run);
+
+  return ptr;
+}
+
+/* Return the object to its run. Empty runs go back to the free lists, unless
+ * it's the only run of its class with free objects. */
+static void slab_free(void *ptr) {
+  run_t *run = run_of(ptr);
+  int was_full = (run->free == 0 && run->bump + run->size > RUN_SIZE - WSIZE);
+
+  *(uint16_t *)ptr = run->free;
+  run->free = ptr - (void *)run;
+  run->nused--;
+
+  if (was_full)
+    run_push(run);
+
+  if (run->nused == 0 && (run->prev >= 0 || run->next >= 0)) {
+    run_remove(run);
+    size_t page = run_page(run);
+    __atomic_fetch_and(&slab_pages[page / 64], ~(1UL << (page % 64)),
+                       __ATOMIC_RELAXED);
+    free(run);
+  }
+}
+#endif /* SLAB */
+
 /* --=[ realloc ]=---------------------------------------------------------- */
+/* A block that realloc has grown before is marked GROWN. When such a block has
+ * to be moved again, it gets reserve_percent of its size as slack, which is
+ * split off as a free block marked RESERVED. Reserved blocks are kept in their
+ * own bucket, which find_fit searches only when no other block fits, so the
+ * next reallocs of the block can take the slack in place. */
+#ifndef RESERVE_MIN
+#define RESERVE_MIN 512 /* Smaller blocks never get slack */
+#endif
+#if defined(SLAB) && RESERVE_MIN <= SLAB_MAX
+#error "RESERVE_MIN must be above SLAB_MAX, slab objects have no header"
+#endif
+
+int mm_realloc_reserve(int percent) {
+  int old = reserve_percent;
+  if (percent >= 0)
+    reserve_percent = percent;
+  return old;
+}
+
+/* Split the part of a growing block after asize bytes off as a reservation.
+ * If the next block is free, the tail just joins it. */
+static void reserve_tail(word_t *block_ptr, size_t asize) {
+  size_t size = bt_size(block_ptr) - asize;
+  word_t *next = bt_next(block_ptr);
+  int next_free = bt_free(next);
+
+  *block_ptr |= GROWN;
+  if (size < MIN_BLOCK)
+    return;
+
+  if (next_free) {
+    free_list_delete(next, get_index(bt_size(next)));
+    MAP(map_absorb(next));
+    size += bt_size(next);
+  }
+  bt_make(block_ptr, asize, USED | GROWN | bt_get_prevfree(block_ptr));
+  word_t *tail = bt_next(block_ptr);
+  bt_make(tail, size, next_free ? FREE : FREE | RESERVED);
+  free_list_append(tail, get_index(size));
+  if (arena->last == block_ptr || (next_free && arena->last == next))
+    arena->last = tail;
+}
+
 /* Check if there is enough space around the block to change the size,
  * if there is space- make a new allocated block and free block (if the split is
- * possible) if there is no space, but the block is at the end of the heap, we
- * can just extend heap, else we just need to malloc the new block and free the
- * old one. */
+ * possible). The free block on the left is used only if the one on the right
+ * is not enough, because the payload has to be moved. If there is no space,
+ * but the block is at the end of the heap, we can just extend heap, else we
+ * just need to malloc the new block and free the old one. */
 void *realloc(void *ptr, size_t size) {
   /* If ptr is NULL, then this is just malloc. */
   if (!ptr)
@@ -548,6 +2246,36 @@ void *realloc(void *ptr, size_t size) {
     free(ptr);
     return NULL;
   }
+#ifdef SLAB
+  /* Slab objects can only be resized within their size class */
+  if (slab_owns(ptr)) {
+    size_t old_size = slab_size(ptr);
+    if (size <= old_size) {
+      STAT(arena->stats->realloc_inplace++);
+      return ptr;
+    }
+    void *new_ptr = malloc(size);
+    if (!new_ptr)
+      return NULL;
+    STAT(arena->stats->realloc_copied++);
+    memcpy(new_ptr, ptr, old_size);
+    slab_free(ptr);
+    return new_ptr;
+  }
+#endif
+
+  /* Mapped blocks are resized without copying, unless they become small */
+  if (block_mapped(ptr)) {
+    if (size >= MMAP_THRESHOLD)
+      return remap_block(ptr, size);
+    void *new_ptr = malloc(size);
+    if (!new_ptr)
+      return NULL;
+    memcpy(new_ptr, ptr, size);
+    unmap_block(ptr);
+    return new_ptr;
+  }
+
   /* variables */
   word_t *block_ptr = bt_header(ptr);
   word_t *next = bt_next(block_ptr);
@@ -555,35 +2283,70 @@ void *realloc(void *ptr, size_t size) {
   /* free_size variable to check if there is free space to realloc without using
    * malloc or extend heap */
   size_t free_size = bt_size(block_ptr);
-  size_t asize = round_up(size + WSIZE); /* new adjusted size */
+  size_t asize = block_size(size); /* new adjusted size */
+  bt_flags grown = (asize > free_size || (*block_ptr & GROWN)) ? GROWN : 0;
 
   int next_free = bt_free(next);
+  int next_reserved = next_free && (*next & RESERVED);
 
   if (next_free)
     free_size += bt_size(next);
 
-  int change_last = (block_ptr == last || (next == last && next_free));
+  int change_last =
+    (block_ptr == arena->last || (next == arena->last && next_free));
+
+  /* If next block is not enough, try the previous one as well. A block at the
+   * end of the heap is extended instead, so it stays in place and keeps
+   * growing there. */
+  word_t *prev = NULL;
+  if (free_size < asize && !change_last && bt_get_prevfree(block_ptr)) {
+    prev = bt_prev(block_ptr);
+    if (free_size + bt_size(prev) >= asize)
+      free_size += bt_size(prev);
+    else
+      prev = NULL;
+  }
+
   /* if the block is at the end of the heap, we can extend heap and change the
    * size of the block in the header */
   if (free_size < asize) {
     if (change_last) {
-      if (extend_heap(asize - free_size) == NULL)
+      if (extend_heap(asize - free_size, false) == NULL)
         return NULL;
 
-      bt_make(block_ptr, asize, USED);
-      last = block_ptr;
+      MAP(map_absorb(bt_next(block_ptr)));
+      bt_make(block_ptr, asize, USED | grown | bt_get_prevfree(block_ptr));
+      /* Unless the heap grew to a huge page boundary, past a free block */
+      if (bt_used(arena->last))
+        arena->last = block_ptr;
+      STAT(arena->stats->realloc_inplace++);
       return ptr;
     }
 
+    /* A block that keeps growing gets slack, unless it is small or would be
+     * mapped */
+    size_t reserve = 0;
+    if ((*block_ptr & GROWN) && size >= RESERVE_MIN && arena->optional)
+      reserve = size / 100 * reserve_percent;
+    if (size + reserve >= MMAP_THRESHOLD)
+      reserve = 0;
+
     /* if there is no space,
     we need to malloc the new block and free the old one  */
-    void *new_ptr = malloc(size);
+    void *new_ptr = malloc(size + reserve);
     /* If malloc() fails, the original block is left untouched. */
     if (!new_ptr)
       return NULL;
 
-    /* Copy the old data. */
-    memcpy(new_ptr, ptr, free_size - WSIZE);
+    /* Copy the old data. malloc may have coalesced the quick lists into the
+     * free block after this one, and handed that out. */
+    STAT(arena->stats->realloc_copied++);
+    memcpy(new_ptr, ptr, bt_size(block_ptr) - WSIZE);
+
+    if (reserve > 0)
+      reserve_tail(bt_header(new_ptr), asize);
+    else if (size >= RESERVE_MIN && size < MMAP_THRESHOLD)
+      *bt_header(new_ptr) |= GROWN;
 
     /* Free the old block. */
     free(ptr);
@@ -595,64 +2358,824 @@ void *realloc(void *ptr, size_t size) {
    * free blocks  */
 
   /* if next block is free, delete it, because it will be changed */
-  if (next_free)
+  if (next_free) {
     free_list_delete(next, get_index(bt_size(next)));
+    MAP(map_absorb(next));
+  }
 
-  if ((free_size - asize) >= ALIGNMENT) {
-    /* Split the block to used and free blocks */
-    bt_make(block_ptr, asize, USED | bt_get_prevfree(block_ptr));
+  /* The block grows to the left, so the payload is moved to the start of the
+   * previous block, once it's off its free list */
+  if (prev != NULL) {
+    size_t old_payload = bt_size(block_ptr) - WSIZE;
+    free_list_delete(prev, get_index(bt_size(prev)));
+    MAP(map_absorb(block_ptr));
+    block_ptr = prev;
+    ptr = memmove(bt_payload(block_ptr), ptr, old_payload);
+    STAT(arena->stats->realloc_moved++);
+  } else {
+    STAT(arena->stats->realloc_inplace++);
+  }
+
+  if ((free_size - asize) >= MIN_BLOCK) {
+    /* Split the block to used and free blocks, what is left of a reservation
+     * stays reserved */
+    bt_make(block_ptr, asize, USED | grown | bt_get_prevfree(block_ptr));
     block_ptr = bt_next(block_ptr);
-    bt_make(block_ptr, free_size - asize, FREE);
+    bt_make(block_ptr, free_size - asize,
+            FREE | (next_reserved ? RESERVED : 0));
     free_list_append(block_ptr, get_index(free_size - asize));
   } else {
-    /* We can't create a new free block with size < ALIGNMENT */
-    bt_make(block_ptr, free_size, USED | bt_get_prevfree(block_ptr));
+    /* We can't create a new free block with size < MIN_BLOCK */
+    bt_make(block_ptr, free_size, USED | grown | bt_get_prevfree(block_ptr));
   }
 
   if (change_last)
-    last = block_ptr;
+    arena->last = block_ptr;
 
   return ptr;
 }
 
 /* --=[ calloc ]=---------------------------------------------------------- */
+/* Only the part of the block that may have been written is cleared: fresh
+ * memory from extend_heap, released pages and mappings already read as zero,
+ * and clearing them would only fault them in. */
+static inline void clear_dirty(void *ptr, size_t bytes, zero_t zero) {
+  void *end = ptr + bytes;
+
+  if (zero.lo < ptr)
+    zero.lo = ptr;
+  if (zero.hi > end)
+    zero.hi = end;
+  if (zero.lo >= zero.hi) {
+    memset(ptr, 0, bytes);
+    return;
+  }
+  memset(ptr, 0, zero.lo - ptr);
+  memset(zero.hi, 0, end - zero.hi);
+}
 
 void *calloc(size_t nmemb, size_t size) {
+  zero_t zero = {NULL, NULL};
+
+  if (size != 0 && nmemb > SIZE_MAX / size)
+    return NULL;
+
   size_t bytes = nmemb * size;
-  void *new_ptr = malloc(bytes);
+  void *new_ptr = alloc(bytes, &zero);
 
   /* If malloc() fails, skip zeroing out the memory. */
   if (new_ptr)
-    memset(new_ptr, 0, bytes);
+    clear_dirty(new_ptr, bytes, zero);
 
   return new_ptr;
 }
 
+/* --=[ batches ]=--------------------------------------------------------- */
+/* Allocate the blocks of a batch one by one, return how many there are */
+static size_t malloc_each(size_t size, size_t n, void **out) {
+  size_t i;
+  for (i = 0; i < n; i++)
+    if ((out[i] = malloc(size)) == NULL)
+      break;
+  return i;
+}
+
+/* Split a used block into n blocks of asize bytes, the last one gets what is
+ * left, and store their payloads in out */
+static void carve(word_t *block_ptr, size_t asize, size_t n, void **out) {
+  size_t last_size = bt_size(block_ptr) - (n - 1) * asize;
+  bt_flags prevfree = bt_get_prevfree(block_ptr);
+  word_t *bt = block_ptr;
+
+  for (size_t i = 0; i < n; i++) {
+    if (i > 0)
+      bt = (void *)bt + asize;
+    PUT(bt, PACK(i < n - 1 ? asize : last_size, USED | (i ? 0 : prevfree)));
+    MAP(map_mark(bt, true));
+    out[i] = bt_payload(bt);
+  }
+  if (arena->last == block_ptr)
+    arena->last = bt;
+}
+
+/* Allocate n blocks of the given size into out and return how many there are.
+ * They are carved from one free block if there is one large enough, else from
+ * as few as the free lists have, and the rest from one heap extension. */
+size_t mm_malloc_batch(size_t size, size_t n, void **out) {
+  if (size == 0 || n == 0)
+    return 0;
+
+  /* Mapped and slab blocks gain nothing from being carved together */
+  size_t asize = block_size(size);
+#ifdef SLAB
+  if (size <= SLAB_MAX)
+    return malloc_each(size, n, out);
+#endif
+  if (size >= MMAP_THRESHOLD || n > MAX_HEAP / asize)
+    return malloc_each(size, n, out);
+  STAT(arena->stats->mallocs[get_index(asize)] += n);
+
+  size_t done = 0;
+  word_t *block_ptr = find_fit(n * asize);
+  if (block_ptr == NULL)
+    block_ptr = find_fit(asize);
+  for (; block_ptr != NULL; block_ptr = find_fit(asize)) {
+    size_t k = bt_size(block_ptr) / asize;
+    if (k > n - done)
+      k = n - done;
+    place(block_ptr, k * asize);
+    carve(block_ptr, asize, k, out + done);
+    if ((done += k) == n)
+      return n;
+  }
+
+  /* No fit found for the rest */
+  size_t extend_size = (n - done) * asize;
+  if (arena->last != NULL && bt_free(arena->last))
+    extend_size -= bt_size(arena->last);
+  /* The heap may still have room for some of the blocks */
+  if ((block_ptr = extend_heap(extend_size, true)) == NULL)
+    return done + malloc_each(size, n - done, out + done);
+  carve(block_ptr, asize, n - done, out + done);
+  return n;
+}
+
+static int by_address(const void *a, const void *b) {
+  uintptr_t x = (uintptr_t)*(void *const *)a;
+  uintptr_t y = (uintptr_t)*(void *const *)b;
+  return (x > y) - (x < y);
+}
+
+/* Free the blocks of an address-ordered array. Neighbours in the array are
+ * merged into one free block, which is coalesced and put on a list once. */
+static void free_sorted(void **ptrs, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    void *ptr = ptrs[i];
+    if (ptr == NULL)
+      continue;
+
+#ifdef SLAB
+    if (slab_owns(ptr)) {
+      slab_free(ptr);
+      continue;
+    }
+#endif
+
+    if (block_mapped(ptr)) {
+      unmap_block(ptr);
+      continue;
+    }
+
+    word_t *block_ptr = bt_header(ptr);
+    size_t size = bt_size(block_ptr);
+    while (i + 1 < n && bt_header(ptrs[i + 1]) == (void *)block_ptr + size) {
+      size += bt_size(bt_header(ptrs[++i]));
+      MAP(map_absorb(bt_header(ptrs[i])));
+    }
+    /* The last block may be one of the merged ones */
+    if (arena->last > block_ptr &&
+        (void *)arena->last < (void *)block_ptr + size)
+      arena->last = block_ptr;
+#ifdef TRIM
+    arena->dirty += size;
+#endif
+    bt_make(block_ptr, size, FREE | bt_get_prevfree(block_ptr));
+
+    if (bt_get_prevfree(block_ptr) || bt_free(bt_next(block_ptr))) {
+      coalesce(block_ptr);
+    } else {
+      free_list_append(block_ptr, get_index(size));
+    }
+  }
+
+#ifdef TRIM
+  return_memory();
+#endif
+}
+
+#ifndef THREADS
+/* Free n blocks at once. The array is sorted by address in place. */
+void mm_free_batch(void **ptrs, size_t n) {
+  qsort(ptrs, n, sizeof(void *), by_address);
+  free_sorted(ptrs, n);
+}
+#endif
+
+#ifdef THREADS
+/* --=[ arena selection ]=------------------------------------------------- */
+/* Returns the arena that the block belongs to */
+static inline arena_t *arena_of(void *ptr) {
+  if (NUM_ARENAS == 1 || ptr < arenas_lo)
+    return main_arena;
+  return arenas_lo + (ptr - arenas_lo) / ARENA_SIZE * ARENA_SIZE;
+}
+
+/* Returns the arena after the given one */
+static inline arena_t *arena_after(arena_t *a) {
+  if (NUM_ARENAS == 1)
+    return a;
+  if (a == main_arena)
+    return arenas_lo;
+  if ((void *)a + ARENA_SIZE < arenas_lo + (NUM_ARENAS - 1) * ARENA_SIZE)
+    return (void *)a + ARENA_SIZE;
+  return main_arena;
+}
+
+/* Returns the arena of the thread, a new thread gets the next one */
+static inline arena_t *home_arena(void) {
+  if (home == NULL) {
+    int index = __atomic_fetch_add(&next_arena, 1, __ATOMIC_RELAXED);
+    home = main_arena;
+    for (int i = 0; i < index % NUM_ARENAS; i++)
+      home = arena_after(home);
+  }
+  return home;
+}
+
+/* Lock the arena and make the allocator work on it */
+static inline void arena_lock(arena_t *a) {
+  pthread_mutex_lock(&a->lock);
+  arena = a;
+}
+
+static inline void arena_unlock(void) {
+  pthread_mutex_unlock(&arena->lock);
+}
+
+/* --=[ remote frees ]=---------------------------------------------------- */
+/* A thread freeing a block of an arena other than its own does not take the
+ * lock, it pushes the block onto the remote list of the arena with a single
+ * CAS. The list is only ever taken as a whole, so there is no ABA problem.
+ * The blocks stay marked as used until the next thread that mallocs from the
+ * arena frees them all under the lock. */
+static inline void remote_push(arena_t *a, void *ptr) {
+  void *head = __atomic_load_n(&a->remote, __ATOMIC_RELAXED);
+  do {
+    *(void **)ptr = head;
+  } while (!__atomic_compare_exchange_n(&a->remote, &head, ptr, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* Free the remote blocks of the locked arena. They are taken REMOTE_BATCH at
+ * a time into an array and sorted by address, so neighbours are merged before
+ * they are coalesced, like in mm_free_batch. The sort is done here rather
+ * than by qsort, which may call malloc while the arena is locked. */
+#ifndef REMOTE_BATCH
+#define REMOTE_BATCH 64
+#endif
+
+static inline void remote_drain(void) {
+  if (__atomic_load_n(&arena->remote, __ATOMIC_RELAXED) == NULL)
+    return;
+  void *ptr = __atomic_exchange_n(&arena->remote, NULL, __ATOMIC_ACQUIRE);
+  void *ptrs[REMOTE_BATCH];
+  while (ptr) {
+    size_t n = 0;
+    for (; ptr && n < REMOTE_BATCH; ptr = *(void **)ptr, n++) {
+      size_t i = n;
+      for (; i > 0 && ptrs[i - 1] > ptr; i--)
+        ptrs[i] = ptrs[i - 1];
+      ptrs[i] = ptr;
+    }
+    free_sorted(ptrs, n);
+  }
+}
+
+/* --=[ per-thread cache ]=------------------------------------------------ */
+/* Every thread keeps up to TCACHE_COUNT recently freed blocks of each size
+ * class below TCACHE_MAX bytes. The cached blocks stay marked as used, so
+ * nobody else touches them, and they are linked through their payloads.
+ * A block of class i is exactly (i + 1) * ALIGNMENT bytes long, so it can
+ * be handed out to any request of that adjusted size without the lock. */
+#define TCACHE_MAX 512
+#define TCACHE_CLASSES (TCACHE_MAX / ALIGNMENT)
+#define TCACHE_COUNT 7
+
+typedef struct {
+  void *head[TCACHE_CLASSES];
+  uint8_t count[TCACHE_CLASSES];
+  bool registered; /* Thread exit will flush the cache */
+} tcache_t;
+
+static __thread tcache_t tcache;
+static pthread_key_t tcache_key;
+
+/* Returns the size class of the request or -1 */
+static inline int tcache_index(size_t size) {
+  if (size == 0)
+    return -1;
+#ifdef SLAB
+  if (size <= SLAB_MAX)
+    return round_up(size) / ALIGNMENT - 1;
+#endif
+  size_t index = block_size(size) / ALIGNMENT - 1;
+  return index < TCACHE_CLASSES ? (int)index : -1;
+}
+
+/* Returns the size class of the allocated block or -1 */
+static inline int tcache_block_index(void *ptr) {
+#ifdef SLAB
+  if (slab_owns(ptr))
+    return slab_size(ptr) / ALIGNMENT - 1;
+#endif
+  /* The header is read without the lock. Other threads may only flip the
+   * PREVFREE bit of our used block concurrently, never its size. */
+  word_t header = __atomic_load_n(bt_header(ptr), __ATOMIC_RELAXED);
+  if (header & MAPPED)
+    return -1;
+  size_t size = bt_size(&header);
+#ifdef SLAB
+  /* These are only handed to requests above SLAB_MAX */
+  if (size <= SLAB_MAX)
+    return -1;
+#endif
+  size_t index = size / ALIGNMENT - 1;
+  return index < TCACHE_CLASSES ? (int)index : -1;
+}
+
+static inline void *tcache_get(size_t size) {
+  int index = tcache_index(size);
+  if (index < 0 || tcache.count[index] == 0)
+    return NULL;
+
+  void *ptr = tcache.head[index];
+  tcache.head[index] = *(void **)ptr;
+  tcache.count[index]--;
+  return ptr;
+}
+
+/* The size class of a block allocated with size bytes, or -1. The block may
+ * be larger than the class, which only wastes the difference. Small heap
+ * blocks are not cached next to slab objects, so those still need a look. */
+static inline int tcache_sized_index(void *ptr, size_t size) {
+#ifdef SLAB
+  if (size <= SLAB_MAX)
+    return tcache_block_index(ptr);
+#endif
+  return tcache_index(size);
+}
+
+static inline bool tcache_put(void *ptr, int index) {
+  if (index < 0 || tcache.count[index] == TCACHE_COUNT)
+    return false;
+
+  if (!tcache.registered) {
+    pthread_setspecific(tcache_key, &tcache);
+    tcache.registered = true;
+  }
+  *(void **)ptr = tcache.head[index];
+  tcache.head[index] = ptr;
+  tcache.count[index]++;
+  return true;
+}
+
+/* Return every cached block to the heap */
+static void tcache_flush(void *arg) {
+  tcache_t *cache = arg;
+  for (int i = 0; i < TCACHE_CLASSES; i++) {
+    while (cache->count[i] > 0) {
+      void *ptr = cache->head[i];
+      cache->head[i] = *(void **)ptr;
+      cache->count[i]--;
+      arena_lock(arena_of(ptr));
+      free(ptr);
+      arena_unlock();
+    }
+  }
+}
+
+static void tcache_key_create(void) {
+  pthread_key_create(&tcache_key, tcache_flush);
+}
+
+/* Forget the blocks of the previous heap, called by mm_init */
+static void tcache_drop(void) {
+  memset(tcache.count, 0, sizeof(tcache.count));
+}
+
+/* --=[ thread-safe entry points ]=---------------------------------------- */
+#undef malloc
+#undef free
+#undef realloc
+#undef calloc
+#undef memalign
+#undef free_sized
+#undef mm_malloc_batch
+#ifdef DRIVER
+#define malloc mm_malloc
+#define free mm_free
+#define realloc mm_realloc
+#define calloc mm_calloc
+#define memalign mm_memalign
+#define free_sized mm_free_sized
+#endif /* def DRIVER */
+
+/* Allocate from the arena of the thread, if it's full - from the others */
+void *malloc(size_t size) {
+  void *ptr = tcache_get(size);
+  if (ptr)
+    return ptr;
+  if (size >= MMAP_THRESHOLD && (ptr = map_block(size)) != NULL)
+    return ptr;
+
+  arena_t *start = home_arena();
+  arena_t *a = start;
+  do {
+    arena_lock(a);
+    remote_drain();
+    ptr = heap_malloc(size);
+    arena_unlock();
+    a = arena_after(a);
+  } while (ptr == NULL && size != 0 && a != start);
+  return ptr;
+}
+
+/* Blocks are always returned to the arena they come from */
+void free(void *ptr) {
+  if (ptr == NULL || tcache_put(ptr, tcache_block_index(ptr)))
+    return;
+  if (block_mapped(ptr)) {
+    unmap_block(ptr);
+    return;
+  }
+
+  arena_t *a = arena_of(ptr);
+  if (a != home) {
+    remote_push(a, ptr);
+    return;
+  }
+  arena_lock(a);
+  heap_free(ptr);
+  arena_unlock();
+}
+
+void free_sized(void *ptr, size_t size) {
+  if (ptr == NULL)
+    return;
+  assert(size <= malloc_usable_size(ptr));
+  if (tcache_put(ptr, tcache_sized_index(ptr, size)))
+    return;
+  if (size >= MMAP_THRESHOLD && block_mapped(ptr)) {
+    unmap_block(ptr);
+    return;
+  }
+
+  arena_t *a = arena_of(ptr);
+  if (a != home) {
+    remote_push(a, ptr);
+    return;
+  }
+  arena_lock(a);
+  heap_free_sized(ptr, size);
+  arena_unlock();
+}
+
+void *realloc(void *ptr, size_t size) {
+  if (ptr == NULL)
+    return malloc(size);
+
+  /* Mapped blocks don't belong to any arena */
+  bool mapped = block_mapped(ptr);
+  if (mapped && size >= MMAP_THRESHOLD)
+    return remap_block(ptr, size);
+
+  arena_lock(mapped ? home_arena() : arena_of(ptr));
+  ptr = heap_realloc(ptr, size);
+  arena_unlock();
+  return ptr;
+}
+
+/* Like malloc, only cached blocks are always cleared */
+void *calloc(size_t nmemb, size_t size) {
+  if (size != 0 && nmemb > SIZE_MAX / size)
+    return NULL;
+
+  size_t bytes = nmemb * size;
+  void *ptr = tcache_get(bytes);
+  if (ptr) {
+    memset(ptr, 0, bytes);
+    return ptr;
+  }
+  if (bytes >= MMAP_THRESHOLD && (ptr = map_block(bytes)) != NULL)
+    return ptr;
+
+  arena_t *start = home_arena();
+  arena_t *a = start;
+  do {
+    arena_lock(a);
+    remote_drain();
+    ptr = heap_calloc(nmemb, size);
+    arena_unlock();
+    a = arena_after(a);
+  } while (ptr == NULL && bytes != 0 && a != start);
+  return ptr;
+}
+
+void *memalign(size_t alignment, size_t size) {
+  if (alignment & (alignment - 1))
+    return NULL;
+  if (alignment <= ALIGNMENT)
+    return malloc(size);
+
+  arena_t *start = home_arena();
+  arena_t *a = start;
+  void *ptr;
+  do {
+    arena_lock(a);
+    remote_drain();
+    ptr = heap_memalign(alignment, size);
+    arena_unlock();
+    a = arena_after(a);
+  } while (ptr == NULL && size != 0 && a != start);
+  return ptr;
+}
+
+/* Batches skip the per-thread cache, they go to the arenas in one piece */
+size_t mm_malloc_batch(size_t size, size_t n, void **out) {
+  arena_t *start = home_arena();
+  arena_t *a = start;
+  size_t done = 0;
+  do {
+    arena_lock(a);
+    remote_drain();
+    done += heap_malloc_batch(size, n - done, out + done);
+    arena_unlock();
+    a = arena_after(a);
+  } while (done < n && size != 0 && a != start);
+  return done;
+}
+
+/* Arenas are address ranges, so after sorting the blocks of each arena are
+ * next to each other and are freed under one lock */
+void mm_free_batch(void **ptrs, size_t n) {
+  qsort(ptrs, n, sizeof(void *), by_address);
+
+  for (size_t i = 0, j; i < n; i = j) {
+    if (ptrs[i] == NULL || block_mapped(ptrs[i])) {
+      if (ptrs[i])
+        unmap_block(ptrs[i]);
+      j = i + 1;
+      continue;
+    }
+
+    arena_t *a = arena_of(ptrs[i]);
+    for (j = i + 1; j < n && !block_mapped(ptrs[j]); j++)
+      if (arena_of(ptrs[j]) != a)
+        break;
+    arena_lock(a);
+    free_sorted(ptrs + i, j - i);
+    arena_unlock();
+  }
+}
+#endif /* THREADS */
+
+/* --=[ posix_memalign and aligned_alloc ]=-------------------------------- */
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+  if (alignment < sizeof(void *) || (alignment & (alignment - 1)))
+    return EINVAL;
+
+  void *ptr = memalign(alignment, size);
+  if (ptr == NULL && size != 0)
+    return ENOMEM;
+  *memptr = ptr;
+  return 0;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+  return memalign(alignment, size);
+}
+
+#ifdef STATS
+/* --=[ statistics ]=------------------------------------------------------ */
+/* Sum up the counters of all arenas */
+void mm_stats(mm_stats_t *stats) {
+  memset(stats, 0, sizeof(*stats));
+  stats->num_buckets = NUM_LIST + 1;
+
+  arena_t *a = main_arena;
+  do {
+#ifdef THREADS
+    pthread_mutex_lock(&a->lock);
+#endif
+    mm_stats_t *s = a->stats;
+    for (int i = 0; i <= RESERVED_INDEX; i++) {
+      stats->mallocs[i] += s->mallocs[i];
+      stats->free_bytes[i] += s->free_bytes[i];
+    }
+    stats->fits += s->fits;
+    stats->probes += s->probes;
+    if (s->max_probes > stats->max_probes)
+      stats->max_probes = s->max_probes;
+    stats->splits += s->splits;
+    stats->coalesce_prev += s->coalesce_prev;
+    stats->coalesce_next += s->coalesce_next;
+    stats->coalesce_both += s->coalesce_both;
+    stats->extends += s->extends;
+    stats->extend_bytes += s->extend_bytes;
+    stats->realloc_inplace += s->realloc_inplace;
+    stats->realloc_moved += s->realloc_moved;
+    stats->realloc_copied += s->realloc_copied;
+    stats->quick_hits += s->quick_hits;
+    stats->quick_flushes += s->quick_flushes;
+#ifdef THREADS
+    pthread_mutex_unlock(&a->lock);
+    a = arena_after(a);
+#endif
+  } while (a != main_arena);
+}
+#endif /* STATS */
+
 /* --=[ checkheap ]=------------------------------------------------------- */
-/* Prints the address of the block, flags, and the address where the next block
- * starts. There is also a separate list of free blocks*/
+static void print_block(word_t *bt) {
+  msg("Block Address: %p Block Header Size: %ld Block Header type: %d Block "
+      "PREVFREE type: %d Block ends at: %p\n",
+      bt, bt_size(bt), bt_used(bt), bt_get_prevfree(bt), bt_next(bt));
+}
+
+/* Prints the tree of large blocks in size order, with the chain of each node */
+static void print_tree(word_t *node) {
+  if (node == NULL)
+    return;
+  print_tree(tree_get(node, TREE_LEFT));
+  for (word_t *bt = node; bt != NULL; bt = get_free_next(bt))
+    print_block(bt);
+  print_tree(tree_get(node, TREE_RIGHT));
+}
+
+/* Walk the heap, and report the blocks that break the boundary tags: the walk
+ * must end at heap_end, PREVFREE must say whether the block before is free,
+ * free blocks need a footer of their size and no free neighbour, and
+ * arena->last must be the last block. With -DBLOCK_MAP the walk follows the
+ * map and checks every header against it, so a broken header does not end
+ * it. Returns the number of free blocks. */
+static size_t check_blocks(void) {
+  word_t *bt = arena->heap_start, *last = NULL, *next;
+  bool prev_free = false;
+  size_t num_free = 0;
+#ifdef BLOCK_MAP
+  bool used;
+  if (bt < arena->heap_end && !map_starts(bt, &used))
+    msg("ERROR: block map has no block at heap start %p\n", bt);
+#endif
+
+  for (; bt < arena->heap_end; bt = next) {
+#ifdef BLOCK_MAP
+    next = map_next(bt);
+    map_starts(bt, &used);
+    if (used != !!bt_used(bt))
+      msg("ERROR: block map has block %p %s, header says %s\n", bt,
+          used ? "used" : "free", bt_used(bt) ? "used" : "free");
+    if (bt_size(bt) != (size_t)((void *)next - (void *)bt)) {
+      msg("ERROR: block map has block %p of size %zu, header says %zu\n", bt,
+          (size_t)((void *)next - (void *)bt), bt_size(bt));
+      prev_free = !used;
+      last = bt;
+      continue;
+    }
+#else
+    if (bt_size(bt) < ALIGNMENT || bt_size(bt) % ALIGNMENT ||
+        bt_size(bt) > (size_t)((void *)arena->heap_end - (void *)bt)) {
+      msg("ERROR: block %p has size %zu\n", bt, bt_size(bt));
+      return num_free;
+    }
+    next = (void *)bt + bt_size(bt);
+#endif
+    if (!!bt_get_prevfree(bt) != prev_free)
+      msg("ERROR: block %p has PREVFREE %s, the block before is %s\n", bt,
+          prev_free ? "clear" : "set", prev_free ? "free" : "used");
+    if (bt_free(bt)) {
+      if (bt_size(bt_footer(bt)) != bt_size(bt))
+        msg("ERROR: free block %p has size %zu, its footer %zu\n", bt,
+            bt_size(bt), bt_size(bt_footer(bt)));
+      if (prev_free)
+        msg("ERROR: free block %p is not coalesced with the one before\n",
+            bt);
+      num_free++;
+    }
+    prev_free = bt_free(bt);
+    last = bt;
+  }
+  if (!!bt_get_prevfree(bt) != prev_free)
+    msg("ERROR: epilogue has PREVFREE %s, the last block is %s\n",
+        prev_free ? "clear" : "set", prev_free ? "free" : "used");
+  if (arena->last != last)
+    msg("ERROR: last is %p, the last block is %p\n", arena->last, last);
+  return num_free;
+}
+
+/* Report the blocks on a free list that are used or in the wrong bucket, and
+ * return how many there are */
+static size_t check_list(word_t *bt, int index) {
+  size_t num_free = 0;
+  for (; bt != NULL; bt = get_free_next(bt), num_free++) {
+    int expected = *bt & RESERVED ? RESERVED_INDEX : get_index(bt_size(bt));
+    if (bt_used(bt))
+      msg("ERROR: used block %p is on free list %d\n", bt, index);
+    else if (expected != index)
+      msg("ERROR: free block %p of size %zu is on list %d instead of %d\n",
+          bt, bt_size(bt), index, expected);
+  }
+  return num_free;
+}
+
+/* The same for the tree of large blocks and the chains of its nodes, whose
+ * sizes must be between lo and hi and which must link back to their parent */
+static size_t check_tree(word_t *node, word_t *parent, size_t lo, size_t hi) {
+  if (node == NULL)
+    return 0;
+  size_t size = bt_size(node);
+  if (size <= lo || size >= hi)
+    msg("ERROR: tree node %p of size %zu is out of order (%zu, %zu)\n", node,
+        size, lo, hi);
+  if (tree_get(node, TREE_PARENT) != parent)
+    msg("ERROR: tree node %p has parent %p instead of %p\n", node,
+        tree_get(node, TREE_PARENT), parent);
+  return check_tree(tree_get(node, TREE_LEFT), node, lo, size) +
+         check_list(node, TREE_INDEX) +
+         check_tree(tree_get(node, TREE_RIGHT), node, size, hi);
+}
+
+/* Every free block of the heap must be on exactly one of the lists */
+static void check_lists(size_t num_free) {
+  size_t listed = check_tree(arena->segregated_list[TREE_INDEX], NULL, 0, -1);
+  for (int i = 0; i < TREE_INDEX; i++)
+    listed += check_list(arena->segregated_list[i], i);
+  listed += check_list(reserved_list(), RESERVED_INDEX);
+  if (listed != num_free)
+    msg("ERROR: %zu blocks on the free lists, %zu free blocks in the heap\n",
+        listed, num_free);
+}
+
+/* Checks the boundary tags, the free lists and the block map if there is one,
+ * and dumps the heap and the free lists if verbose is above 1 */
 void mm_checkheap(int verbose) {
   word_t *bt;
+  check_lists(check_blocks());
+  if (verbose < 2)
+    return;
   msg("Check Heap \n");
-  for (bt = heap_start; bt && bt_size(bt) > 0; bt = bt_next(bt)) {
-    msg("Block Address: %p Block Header Size: %ld Block Header type: %d Block "
-        "PREVFREE type: %d Block ends at: %p\n",
-        bt, bt_size(bt), bt_used(bt), bt_get_prevfree(bt), bt_next(bt));
+  for (bt = arena->heap_start; bt && bt_size(bt) > 0; bt = bt_next(bt)) {
+    print_block(bt);
   }
-  msg("Heap start: %p Heap end: %p last: %p \n", heap_start, heap_end, last);
+  msg("Heap start: %p Heap end: %p last: %p \n", arena->heap_start,
+      arena->heap_end, arena->last);
   msg("Check Heap End\n\n");
-
   msg("Check free list \n");
-  for (int i = 0; i < NUM_LIST; i++) {
+  for (int i = 0; i < TREE_INDEX; i++) {
     msg("\n%d LIST\n", i);
-    for (bt = segregated_list[i]; bt != NULL; bt = get_free_next(bt)) {
-      msg(
-        "Block Address: %p Block Header Size: %ld Block Header type: %d Block "
-        "PREVFREE type: %d Block ends at: %p\n",
-        bt, bt_size(bt), bt_used(bt), bt_get_prevfree(bt), bt_next(bt));
+    for (bt = arena->segregated_list[i]; bt != NULL; bt = get_free_next(bt)) {
+      print_block(bt);
     }
   }
+  if (arena->optional && arena->optional->rover)
+    msg("\nNext fit rover: %p in LIST %d\n", arena->optional->rover,
+        (int)arena->optional->rover_index);
+  msg("\n%d TREE\n", TREE_INDEX);
+  print_tree(arena->segregated_list[TREE_INDEX]);
+  msg("\n%d RESERVED\n", RESERVED_INDEX);
+  for (bt = reserved_list(); bt != NULL; bt = get_free_next(bt)) {
+    print_block(bt);
+  }
+  for (int i = 0; arena->quick != NULL && i < QUICK_CLASSES; i++) {
+    if (arena->quick->head[i] < 0)
+      continue;
+    msg("\nQUICK %d (%d blocks)\n", (i + 1) * ALIGNMENT,
+        (int)arena->quick->len[i]);
+    for (word_t offset = arena->quick->head[i]; offset >= 0;
+         offset = *(arena->heap_start + offset + 1))
+      print_block(arena->heap_start + offset);
+  }
 
-  msg("Heap start: %p Heap end: %p last: %p \n", heap_start, heap_end, last);
+  msg("Heap start: %p Heap end: %p last: %p \n", arena->heap_start,
+      arena->heap_end, arena->last);
   msg("Check free list \n\n");
 }
+
+#ifdef DRIVER
+const mm_allocator_t mm_allocator = {
+#ifdef WIDE
+  "wide",
+#else
+  "compact",
+#endif
+  MAX_HEAP,
+  mm_init,
+  mm_malloc,
+  mm_free,
+  mm_realloc,
+  mm_memalign,
+  mm_malloc_batch,
+  mm_free_batch,
+  mm_usable_size,
+  mm_free_sized,
+  mm_realloc_reserve,
+  mm_quick_limit,
+  mm_fit_policy,
+  mm_free_order,
+  mm_grow_percent,
+  mm_checkheap,
+#ifdef STATS
+  mm_stats,
+#endif
+};
+#endif /* def DRIVER */
@@ -7,6 +7,11 @@ extern void *mm_malloc(size_t size);
 extern void mm_free(void *ptr);
 extern void *mm_realloc(void *ptr, size_t size);
 extern void *mm_calloc(size_t nmemb, size_t size);
+extern void *mm_memalign(size_t alignment, size_t size);
+extern int mm_posix_memalign(void **memptr, size_t alignment, size_t size);
+extern void *mm_aligned_alloc(size_t alignment, size_t size);
+extern size_t mm_usable_size(void *ptr);
+extern void mm_free_sized(void *ptr, size_t size);
 
 #else
 
@@ -15,11 +20,116 @@ extern void *malloc(size_t size);
 extern void free(void *ptr);
 extern void *realloc(void *ptr, size_t size);
 extern void *calloc(size_t nmemb, size_t size);
+extern void *memalign(size_t alignment, size_t size);
+extern int posix_memalign(void **memptr, size_t alignment, size_t size);
+extern void *aligned_alloc(size_t alignment, size_t size);
+extern size_t malloc_usable_size(void *ptr);
+extern void free_sized(void *ptr, size_t size);
 
 #endif
 
 extern int mm_init(void);
 
+/* Set the slack given to blocks that keep growing with realloc, in percent of
+   their size (if percent >= 0), and return the previous value. */
+extern int mm_realloc_reserve(int percent);
+
+/* Set the number of freed blocks of each small size that wait on a quick list
+   before they are coalesced (if limit >= 0, 0 coalesces at once), and return
+   the previous value. The lists are only set up by mm_init when the limit is
+   not 0 then. */
+extern int mm_quick_limit(int limit);
+
+/* Placement policies of mm_fit_policy: the block malloc takes from the first
+   bucket that has any large enough is the first one, the first one after where
+   the last search of that bucket stopped, the smallest one, or the smallest of
+   the first few (good fit). */
+enum { FIT_FIRST, FIT_NEXT, FIT_BEST, FIT_GOOD, NUM_FIT_POLICIES };
+
+/* Orders of the free lists for mm_free_order: last in first out, or sorted by
+   address */
+enum { FREE_LIFO, FREE_ADDRESS, NUM_FREE_ORDERS };
+
+/* Set the placement policy (if policy >= 0), and return the previous one. */
+extern int mm_fit_policy(int policy);
+
+/* Set the order in which freed blocks are put on the free lists (if
+   order >= 0), and return the previous one. */
+extern int mm_free_order(int order);
+
+/* Set the most the heap grows by past what a miss needs, in percent of its
+   size (if percent >= 0, 0 grows by what is missing only), and return the
+   previous value. */
+extern int mm_grow_percent(int percent);
+
+/* Allocate n blocks of size bytes into out, and return how many were
+   allocated. Blocks of a batch are freed one by one or with mm_free_batch. */
+extern size_t mm_malloc_batch(size_t size, size_t n, void **out);
+
+/* Free the n blocks in ptrs, which may hold NULLs. The array is sorted by
+   address in the process, so that neighbours are merged only once. */
+extern void mm_free_batch(void **ptrs, size_t n);
+
+#ifdef STATS
+#define MM_STATS_BUCKETS 128 /* at least the number of buckets of any build */
+
+/* Counters kept by the allocator when it is built with -DSTATS. They start
+   from zero in mm_init. Requests served by the per-thread cache of the
+   thread-safe build and mapped blocks are not counted. */
+typedef struct {
+  int num_buckets;                            /* used entries of the arrays */
+  unsigned long mallocs[MM_STATS_BUCKETS];    /* by bucket of their size */
+  unsigned long free_bytes[MM_STATS_BUCKETS]; /* on each free list now */
+  unsigned long fits;          /* searches for a free block */
+  unsigned long probes;        /* free blocks looked at by all of them */
+  unsigned long max_probes;    /* ... and by the longest one */
+  unsigned long splits;        /* free blocks split by malloc */
+  unsigned long coalesce_prev; /* freed blocks merged with the previous, */
+  unsigned long coalesce_next; /* the next */
+  unsigned long coalesce_both; /* or both neighbours */
+  unsigned long extends;       /* heap extensions */
+  unsigned long extend_bytes;  /* ... and the bytes they added */
+  unsigned long realloc_inplace; /* reallocs that kept the block, */
+  unsigned long realloc_moved;   /* grew it to the left */
+  unsigned long realloc_copied;  /* or copied it to a new block */
+  unsigned long quick_hits;      /* mallocs served from a quick list */
+  unsigned long quick_flushes;   /* times the quick lists were coalesced */
+} mm_stats_t;
+
+extern void mm_stats(mm_stats_t *stats);
+#endif
+
 /* This is largely for debugging.  You can do what you want with the
    verbose flag; we don't care. */
 extern void mm_checkheap(int verbose);
+
+#ifdef DRIVER
+/* The entry points of one build of the allocator. The driver links two: the
+   one of its own flags (mm_allocator), and the same with the 64-bit heap
+   layout of -DWIDE (mm64_allocator, whose symbols the Makefile renames). */
+typedef struct {
+  const char *layout; /* "compact" or "wide" */
+  size_t max_heap;    /* MAX_HEAP of the build */
+  int (*init)(void);
+  void *(*malloc)(size_t size);
+  void (*free)(void *ptr);
+  void *(*realloc)(void *ptr, size_t size);
+  void *(*memalign)(size_t alignment, size_t size);
+  size_t (*malloc_batch)(size_t size, size_t n, void **out);
+  void (*free_batch)(void **ptrs, size_t n);
+  size_t (*usable_size)(void *ptr);
+  void (*free_sized)(void *ptr, size_t size);
+  int (*realloc_reserve)(int percent);
+  int (*quick_limit)(int limit);
+  int (*fit_policy)(int policy);
+  int (*free_order)(int order);
+  int (*grow_percent)(int percent);
+  void (*checkheap)(int verbose);
+#ifdef STATS
+  void (*stats)(mm_stats_t *stats);
+#endif
+} mm_allocator_t;
+
+extern const mm_allocator_t mm_allocator;
+extern const mm_allocator_t mm64_allocator;
+#endif
@@ -0,0 +1,538 @@
+/*
+ * mmtrace.c - record the allocation requests of a program as a trace
+ *
+ * Build with `make libmmtrace.so` and run the program with
+ *
+ *   MMTRACE=prog.rep LD_PRELOAD=./libmmtrace.so prog
+ *
+ * The shim defines malloc, free, realloc, calloc and the aligned allocation
+ * functions (see the interpositioning part of mm.h) and forwards them to the
+ * next definition in the lookup order - usually libc, but an allocator
+ * preloaded after the shim works as well.
+ *
+ * Every call takes a number from one global counter, which orders the calls of
+ * all threads, and is stored in a buffer of the calling thread. Full buffers
+ * are pushed to a lock-free stack, from which a writer thread appends them to
+ * a temporary log. At exit the log is sorted by number, pointers are turned
+ * into block ids and the trace is written in the format read_trace reads:
+ * binary if the file name ends with ".bin", text otherwise.
+ *
+ * The order is exact for calls in one thread. Across threads, malloc takes its
+ * number after the block was returned and free before it is released, so that
+ * a block is never freed before it was allocated. realloc does both: it
+ * records the release of the old block before the call and the new block
+ * after it, and the two become one request. Requests that do not make
+ * sense anyway (free of an unknown pointer, failed allocations) are dropped.
+ * Buffers of threads still running at exit are lost.
+ */
+#define _GNU_SOURCE /* RTLD_NEXT */
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "mm.h"
+#include "trace.h"
+
+/* Number of calls in one thread buffer */
+#ifndef BUF_RECORDS
+#define BUF_RECORDS 32768
+#endif
+
+/* How long the writer sleeps when there is nothing to write, in ms */
+#ifndef WRITE_INTERVAL
+#define WRITE_INTERVAL 10
+#endif
+
+/* One intercepted call */
+typedef struct {
+  uint64_t seq;   /* position in the global order */
+  uint32_t type;  /* ALLOC, FREE, REALLOC or MEMALIGN */
+  uint32_t after; /* REALLOC: 0 for the release of old, 1 for the result */
+  uint64_t size;  /* requested size */
+  uintptr_t ptr;  /* returned or freed (FREE) pointer */
+  uintptr_t old;  /* pointer passed to realloc, or alignment (MEMALIGN) */
+} record_t;
+
+typedef struct buffer {
+  struct buffer *next; /* in the stack of full buffers */
+  size_t count;
+  record_t records[BUF_RECORDS];
+} buffer_t;
+
+static void *(*real_malloc)(size_t);
+static void (*real_free)(void *);
+static void *(*real_realloc)(void *, size_t);
+static void *(*real_calloc)(size_t, size_t);
+static void *(*real_memalign)(size_t, size_t);
+static int (*real_posix_memalign)(void **, size_t, size_t);
+static void *(*real_aligned_alloc)(size_t, size_t);
+
+static _Atomic uint64_t seq;
+static _Atomic(buffer_t *) full;
+static atomic_int stop;
+static int recording;
+static int log_fd = -1;
+static char log_name[4096];
+static pthread_t writer;
+static pthread_key_t buffer_key;
+
+/* Set in threads that are inside the shim or belong to it: their calls go
+ * straight to the allocator. Initial-exec TLS does not allocate on access. */
+static __thread int internal __attribute__((tls_model("initial-exec")));
+static __thread buffer_t *current __attribute__((tls_model("initial-exec")));
+
+/* --=[ forwarding ]=------------------------------------------------------- */
+
+/* dlsym may call calloc before it knows where calloc is; serve that from
+ * here. Such blocks are never freed. */
+static char bootstrap[4096] __attribute__((aligned(16)));
+static size_t bootstrap_used;
+
+static int from_bootstrap(void *ptr) {
+  return (char *)ptr >= bootstrap &&
+         (char *)ptr < bootstrap + sizeof(bootstrap);
+}
+
+static void *bootstrap_calloc(size_t nmemb, size_t size) {
+  size_t len = (nmemb * size + 15) & ~(size_t)15;
+  if (len > sizeof(bootstrap) - bootstrap_used)
+    return NULL;
+  void *ptr = bootstrap + bootstrap_used;
+  bootstrap_used += len;
+  return ptr;
+}
+
+static void *bootstrap_malloc(size_t size) {
+  return bootstrap_calloc(1, size);
+}
+
+static void resolve(void) {
+  static int resolving;
+  if (resolving)
+    return;
+  resolving = 1;
+  real_malloc = bootstrap_malloc;
+  real_calloc = bootstrap_calloc;
+  real_malloc = dlsym(RTLD_NEXT, "malloc");
+  real_free = dlsym(RTLD_NEXT, "free");
+  real_realloc = dlsym(RTLD_NEXT, "realloc");
+  real_calloc = dlsym(RTLD_NEXT, "calloc");
+  real_memalign = dlsym(RTLD_NEXT, "memalign");
+  real_posix_memalign = dlsym(RTLD_NEXT, "posix_memalign");
+  real_aligned_alloc = dlsym(RTLD_NEXT, "aligned_alloc");
+  resolving = 0;
+}
+
+/* --=[ recording ]=-------------------------------------------------------- */
+
+static void write_all(int fd, const void *data, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, data, len);
+    if (n <= 0) {
+      perror("mmtrace: write");
+      return;
+    }
+    data = (const char *)data + n;
+    len -= n;
+  }
+}
+
+static void retire(buffer_t *buf) {
+  buf->next = atomic_load_explicit(&full, memory_order_relaxed);
+  while (!atomic_compare_exchange_weak_explicit(
+    &full, &buf->next, buf, memory_order_release, memory_order_relaxed))
+    ;
+}
+
+/* Write out all full buffers; only the writer (or exit, after it stopped) */
+static void drain(void) {
+  buffer_t *buf = atomic_exchange_explicit(&full, NULL, memory_order_acquire);
+  while (buf) {
+    buffer_t *next = buf->next;
+    write_all(log_fd, buf->records, buf->count * sizeof(record_t));
+    munmap(buf, sizeof(buffer_t));
+    buf = next;
+  }
+}
+
+static void *write_log(void *arg) {
+  internal = 1;
+  struct timespec interval = {0, WRITE_INTERVAL * 1000000L};
+  while (!atomic_load_explicit(&stop, memory_order_acquire)) {
+    drain();
+    nanosleep(&interval, NULL);
+  }
+  return arg;
+}
+
+/* The writer thread does not exist in a child process */
+static void stop_in_child(void) {
+  recording = 0;
+}
+
+/* Push the buffer of an exiting thread */
+static void thread_exit(void *buf) {
+  current = NULL;
+  retire(buf);
+}
+
+static record_t *record(uint32_t type) {
+  buffer_t *buf = current;
+  if (buf == NULL || buf->count == BUF_RECORDS) {
+    if (buf)
+      retire(buf);
+    buf = mmap(NULL, sizeof(buffer_t), PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf == MAP_FAILED)
+      return NULL;
+    buf->count = 0;
+    current = buf;
+    internal = 1;
+    pthread_setspecific(buffer_key, buf);
+    internal = 0;
+  }
+  record_t *r = &buf->records[buf->count++];
+  r->seq = atomic_fetch_add_explicit(&seq, 1, memory_order_relaxed);
+  r->type = type;
+  return r;
+}
+
+/* --=[ interposed functions ]=--------------------------------------------- */
+
+void *malloc(size_t size) {
+  if (!real_malloc)
+    resolve();
+  void *ptr = real_malloc(size);
+  if (recording && !internal && ptr) {
+    record_t *r = record(ALLOC);
+    if (r) {
+      r->size = size;
+      r->ptr = (uintptr_t)ptr;
+    }
+  }
+  return ptr;
+}
+
+void *calloc(size_t nmemb, size_t size) {
+  if (!real_calloc)
+    resolve();
+  void *ptr = real_calloc(nmemb, size);
+  if (recording && !internal && ptr) {
+    record_t *r = record(ALLOC);
+    if (r) {
+      r->size = nmemb * size;
+      r->ptr = (uintptr_t)ptr;
+    }
+  }
+  return ptr;
+}
+
+void free(void *ptr) {
+  if (ptr == NULL || from_bootstrap(ptr))
+    return;
+  if (!real_free)
+    resolve();
+  if (!real_free)
+    return; /* called by dlsym in resolve, leak it */
+  if (recording && !internal) {
+    record_t *r = record(FREE);
+    if (r)
+      r->ptr = (uintptr_t)ptr;
+  }
+  real_free(ptr);
+}
+
+void *realloc(void *old, size_t size) {
+  if (!real_realloc)
+    resolve();
+  if (from_bootstrap(old)) {
+    void *ptr = malloc(size);
+    size_t left = bootstrap + sizeof(bootstrap) - (char *)old;
+    if (ptr)
+      memcpy(ptr, old, size < left ? size : left);
+    return ptr;
+  }
+  if (!recording || internal || old == NULL || size == 0) {
+    if (old == NULL)
+      return malloc(size);
+    if (size == 0) {
+      free(old);
+      return NULL;
+    }
+    return real_realloc(old, size);
+  }
+  /* The old block may be released inside and the new one may have been freed
+   * by another thread just before, so each gets a number of its own */
+  record_t *r = record(REALLOC);
+  if (r) {
+    r->after = 0;
+    r->old = (uintptr_t)old;
+  }
+  void *ptr = real_realloc(old, size);
+  if ((r = record(REALLOC))) {
+    r->after = 1;
+    r->size = size;
+    r->ptr = (uintptr_t)ptr;
+    r->old = (uintptr_t)old;
+  }
+  return ptr;
+}
+
+static void record_aligned(void *ptr, size_t alignment, size_t size) {
+  if (recording && !internal && ptr) {
+    record_t *r = record(MEMALIGN);
+    if (r) {
+      r->size = size;
+      r->ptr = (uintptr_t)ptr;
+      r->old = alignment;
+    }
+  }
+}
+
+void *memalign(size_t alignment, size_t size) {
+  if (!real_memalign)
+    resolve();
+  void *ptr = real_memalign(alignment, size);
+  record_aligned(ptr, alignment, size);
+  return ptr;
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+  if (!real_posix_memalign)
+    resolve();
+  int err = real_posix_memalign(memptr, alignment, size);
+  if (err == 0)
+    record_aligned(*memptr, alignment, size);
+  return err;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+  if (!real_aligned_alloc)
+    resolve();
+  void *ptr = real_aligned_alloc(alignment, size);
+  record_aligned(ptr, alignment, size);
+  return ptr;
+}
+
+/* --=[ writing the trace ]=------------------------------------------------ */
+
+static int by_seq(const void *a, const void *b) {
+  uint64_t x = ((const record_t *)a)->seq, y = ((const record_t *)b)->seq;
+  return x < y ? -1 : x > y;
+}
+
+/* Open-addressing map from live pointers to block ids */
+typedef struct {
+  uintptr_t *keys;
+  int32_t *ids;
+  size_t mask, used;
+} idmap_t;
+
+#define TOMBSTONE ((uintptr_t)1)
+
+static size_t slot_of(idmap_t *m, uintptr_t key) {
+  size_t i = (key >> 4) * 0x9E3779B97F4A7C15ULL & m->mask;
+  while (m->keys[i] != key && m->keys[i] != 0)
+    i = (i + 1) & m->mask;
+  return i;
+}
+
+static void map_insert(idmap_t *m, uintptr_t key, int32_t id);
+
+static void map_grow(idmap_t *m) {
+  idmap_t old = *m;
+  m->mask = old.keys ? old.mask * 2 + 1 : 1023;
+  m->keys = calloc(m->mask + 1, sizeof(*m->keys));
+  m->ids = calloc(m->mask + 1, sizeof(*m->ids));
+  m->used = 0;
+  if (!m->keys || !m->ids) {
+    fputs("mmtrace: out of memory\n", stderr);
+    exit(EXIT_FAILURE);
+  }
+  for (size_t i = 0; old.keys && i <= old.mask; i++)
+    if (old.keys[i] > TOMBSTONE)
+      map_insert(m, old.keys[i], old.ids[i]);
+  free(old.keys);
+  free(old.ids);
+}
+
+static void map_insert(idmap_t *m, uintptr_t key, int32_t id) {
+  if (2 * (m->used + 1) > m->mask)
+    map_grow(m);
+  size_t i = slot_of(m, key);
+  if (m->keys[i] == 0)
+    m->used++;
+  m->keys[i] = key;
+  m->ids[i] = id;
+}
+
+/* Remove key and return its id, or -1 if it is not in the map */
+static int32_t map_remove(idmap_t *m, uintptr_t key) {
+  if (!m->keys)
+    return -1;
+  size_t i = slot_of(m, key);
+  if (m->keys[i] != key)
+    return -1;
+  m->keys[i] = TOMBSTONE;
+  return m->ids[i];
+}
+
+/* Turn the sorted records into requests, in place. Returns their number. */
+static size_t to_requests(record_t *recs, size_t n, traceop_t *ops,
+                          int32_t *num_ids) {
+  idmap_t ids = {NULL, NULL, 0, 0};
+  /* Blocks between the two records of a realloc, by the old pointer */
+  idmap_t moving = {NULL, NULL, 0, 0};
+  size_t num_ops = 0;
+  int32_t next_id = 0;
+
+  for (size_t i = 0; i < n; i++) {
+    record_t *r = &recs[i];
+    traceop_t op = {.type = r->type, .index = -1, .size = r->size};
+
+    if (r->type == FREE) {
+      if ((op.index = map_remove(&ids, r->ptr)) < 0)
+        continue;
+      op.size = 0;
+    } else if (r->type == REALLOC && !r->after) {
+      int32_t id = map_remove(&ids, r->old);
+      if (id >= 0)
+        map_insert(&moving, r->old, id);
+      continue;
+    } else {
+      if (r->type == REALLOC) {
+        op.index = map_remove(&moving, r->old);
+        if (r->ptr == 0 && op.index >= 0)
+          map_insert(&ids, r->old, op.index); /* the old block stays */
+        if (op.index < 0)
+          op.type = ALLOC;
+      }
+      if (r->ptr == 0)
+        continue; /* failed */
+      if (r->type == MEMALIGN)
+        op.align = r->old ? __builtin_ctzl(r->old) : 0;
+      if (op.type == ALLOC || op.type == MEMALIGN) {
+        /* A pointer still in the map was freed without us seeing it */
+        map_remove(&ids, r->ptr);
+        op.index = next_id++;
+      }
+      map_insert(&ids, r->ptr, op.index);
+    }
+    ops[num_ops++] = op;
+  }
+
+  free(ids.keys);
+  free(ids.ids);
+  free(moving.keys);
+  free(moving.ids);
+  *num_ids = next_id;
+  return num_ops;
+}
+
+static void write_trace(const char *name, traceop_t *ops, size_t num_ops,
+                        int32_t num_ids) {
+  FILE *f = fopen(name, "w");
+  if (!f) {
+    perror(name);
+    return;
+  }
+
+  size_t len = strlen(name);
+  if (len > 4 && strcmp(name + len - 4, ".bin") == 0) {
+    tracehdr_t hdr = {TRACE_MAGIC, TRACE_VERSION, 1, num_ids, num_ops, 1,
+                      {0, 0, 0}};
+    fwrite(&hdr, sizeof(hdr), 1, f);
+    fwrite(ops, sizeof(*ops), num_ops, f);
+  } else {
+    fprintf(f, "1\n%d\n%zu\n1\n", num_ids, num_ops);
+    for (size_t i = 0; i < num_ops; i++) {
+      if (ops[i].type == FREE)
+        fprintf(f, "f %d\n", ops[i].index);
+      else if (ops[i].type == MEMALIGN)
+        fprintf(f, "m %d %lu %lu\n", ops[i].index, 1UL << ops[i].align,
+                (unsigned long)ops[i].size);
+      else
+        fprintf(f, "%c %d %lu\n", ops[i].type == ALLOC ? 'a' : 'r',
+                ops[i].index, (unsigned long)ops[i].size);
+    }
+  }
+  fclose(f);
+}
+
+/* --=[ start and exit ]=--------------------------------------------------- */
+
+__attribute__((constructor)) static void mmtrace_start(void) {
+  internal = 1;
+  if (!real_malloc)
+    resolve();
+
+  const char *name = getenv("MMTRACE");
+  if (name == NULL)
+    name = "mmtrace.rep";
+  snprintf(log_name, sizeof(log_name), "%s.XXXXXX", name);
+  if ((log_fd = mkstemp(log_name)) < 0) {
+    perror("mmtrace: log");
+    internal = 0;
+    return;
+  }
+
+  pthread_key_create(&buffer_key, thread_exit);
+  pthread_atfork(NULL, NULL, stop_in_child);
+  if (pthread_create(&writer, NULL, write_log, NULL) != 0) {
+    perror("mmtrace: writer");
+    internal = 0;
+    return;
+  }
+  recording = 1;
+  internal = 0;
+}
+
+__attribute__((destructor)) static void mmtrace_finish(void) {
+  if (!recording)
+    return;
+  internal = 1;
+  recording = 0;
+
+  atomic_store_explicit(&stop, 1, memory_order_release);
+  pthread_join(writer, NULL);
+  if (current) {
+    pthread_setspecific(buffer_key, NULL);
+    retire(current);
+    current = NULL;
+  }
+  drain();
+
+  off_t len = lseek(log_fd, 0, SEEK_END);
+  size_t n = len / sizeof(record_t);
+  record_t *recs = NULL;
+  if (n > 0) {
+    recs = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, log_fd, 0);
+    if (recs == MAP_FAILED) {
+      perror("mmtrace: log");
+      n = 0;
+    }
+  }
+  qsort(recs, n, sizeof(record_t), by_seq);
+
+  /* Requests are smaller than records, so they can overwrite them */
+  int32_t num_ids;
+  traceop_t *ops = (traceop_t *)recs;
+  size_t num_ops = n ? to_requests(recs, n, ops, &num_ids) : 0;
+  if (n == 0)
+    num_ids = 0;
+
+  const char *name = getenv("MMTRACE");
+  write_trace(name ? name : "mmtrace.rep", ops, num_ops, num_ids);
+
+  if (n > 0)
+    munmap(recs, len);
+  close(log_fd);
+  unlink(log_name);
+}
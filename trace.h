@@ -0,0 +1,36 @@
+/*
+ * trace.h - binary trace format, shared by mdriver, the trace recorder
+ *           (mmtrace.c) and the trace generator (tracegen.c)
+ *
+ * A binary trace is a tracehdr_t followed by num_ops traceop_t records, all
+ * in host byte order. trace2bin.py writes the same layout.
+ */
+#include <stdint.h>
+
+#define TRACE_MAGIC "mmtrace"
+#define TRACE_VERSION 1
+
+/* Request types. A batch covers the block ids from index to index+count-1. */
+enum { ALLOC, FREE, REALLOC, MEMALIGN, ALLOC_BATCH, FREE_BATCH, NUM_TYPES };
+
+/* A single trace operation (allocator request). The layout is fixed, because
+ * mdriver uses the records of a binary trace in place. */
+typedef struct {
+  uint16_t type; /* type of request */
+  union {
+    uint16_t align; /* log2 of the alignment of a memalign request */
+    uint16_t count; /* number of blocks of a batch */
+  };
+  int32_t index; /* index for free() to use later */
+  uint64_t size; /* byte size of alloc/realloc request */
+} traceop_t;
+
+typedef struct {
+  char magic[8]; /* TRACE_MAGIC, NUL-terminated */
+  uint32_t version;
+  uint32_t weight;
+  uint32_t num_ids;
+  uint32_t num_ops;
+  uint32_t ignore_ranges;
+  uint32_t pad[3]; /* keeps the records 16-byte aligned */
+} tracehdr_t;
@@ -0,0 +1,69 @@
+#!/usr/bin/env python3
+
+# Converts text traces (.rep) to the binary format that mdriver maps in
+# place.  The layout must match tracehdr_t and traceop_t in trace.h.
+
+import struct
+import sys
+
+
+MAGIC = b'mmtrace\0'
+VERSION = 1
+HEADER = struct.Struct('=8s8I')
+RECORD = struct.Struct('=HHiQ')
+TYPES = {'a': 0, 'f': 1, 'r': 2, 'm': 3, 'A': 4, 'F': 5}
+
+
+def convert(src, dst):
+    with open(src) as f:
+        tokens = f.read().split()
+
+    weight, num_ids, num_ops, ignore_ranges = map(int, tokens[:4])
+    records = []
+    pos = 4
+    while len(records) < num_ops and pos < len(tokens):
+        kind = tokens[pos]
+        if kind[0] not in TYPES:
+            sys.exit('%s: bogus type character (%s)' % (src, kind[0]))
+        if kind[0] == 'f':
+            records.append(RECORD.pack(TYPES['f'], 0, int(tokens[pos + 1]), 0))
+            pos += 2
+        elif kind[0] == 'm':
+            align = int(tokens[pos + 2])
+            if align <= 0 or align & (align - 1):
+                sys.exit('%s: bad alignment (%d)' % (src, align))
+            records.append(RECORD.pack(TYPES['m'], align.bit_length() - 1,
+                                       int(tokens[pos + 1]),
+                                       int(tokens[pos + 3])))
+            pos += 4
+        elif kind[0] in 'AF':
+            count = int(tokens[pos + 2])
+            if count <= 0 or count > 0xffff:
+                sys.exit('%s: bad batch length (%d)' % (src, count))
+            size = int(tokens[pos + 3]) if kind[0] == 'A' else 0
+            records.append(RECORD.pack(TYPES[kind[0]], count,
+                                       int(tokens[pos + 1]), size))
+            pos += 4 if kind[0] == 'A' else 3
+        else:
+            records.append(RECORD.pack(TYPES[kind[0]], 0, int(tokens[pos + 1]),
+                                       int(tokens[pos + 2])))
+            pos += 3
+
+    if len(records) != num_ops:
+        sys.exit('%s: expected %d requests, found %d' %
+                 (src, num_ops, len(records)))
+
+    with open(dst, 'wb') as f:
+        f.write(HEADER.pack(MAGIC, VERSION, weight, num_ids, num_ops,
+                            ignore_ranges, 0, 0, 0))
+        f.write(b''.join(records))
+
+
+if __name__ == '__main__':
+    if len(sys.argv) < 2:
+        sys.exit('usage: %s trace.rep... (writes trace.bin next to each)' %
+                 sys.argv[0])
+
+    for src in sys.argv[1:]:
+        dst = (src[:-4] if src.endswith('.rep') else src) + '.bin'
+        convert(src, dst)
@@ -0,0 +1,425 @@
+/*
+ * tracegen.c - write synthetic traces for mdriver
+ *
+ *   tracegen -n 1000000 -s power:16:65536:1.5 -l fifo -t 10000 -o big.rep
+ *
+ * Every step either allocates a block or frees one. The chance to allocate is
+ * target / (target + live), so the number of live blocks settles around the
+ * live-set target. Blocks are freed in the order given by the lifetime
+ * policy; with -r, a fraction of the steps reallocates a live block instead.
+ * The last requests free all blocks that are still live, so the trace has
+ * exactly the requested number of operations.
+ *
+ * Block ids are reused after a free, so num_ids is the largest live set and
+ * mdriver's per-block arrays stay small even for very long traces. Traces
+ * with names ending in ".bin" are written in the binary format of trace.h.
+ */
+#include <errno.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+/* Traces with more operations than this skip the quadratic range checks */
+#define RANGES_MAX_OPS 100000
+
+/* Blocks grown by realloc past this get a fresh random size */
+#define MAX_REGROW_SIZE (1 << 24)
+
+typedef enum { UNIFORM, POWER, BIMODAL } size_dist_t;
+typedef enum { LIFO, FIFO, RANDOM, LONG_LIVED } lifetime_t;
+typedef enum { REGROW_RANDOM, REGROW_LINEAR, REGROW_GEOMETRIC } regrow_t;
+
+/* Parameters from the command line */
+static size_dist_t size_dist = UNIFORM;
+static double size_a = 16, size_b = 4096, size_c = 0; /* see parse_sizes */
+static lifetime_t lifetime = RANDOM;
+static double long_fraction = 0.1; /* blocks never freed (LONG_LIVED) */
+static double realloc_fraction = 0;
+static double aligned_fraction = 0; /* allocations made with memalign */
+static uint16_t align_log2;
+static regrow_t regrow = REGROW_RANDOM;
+static double regrow_step = 0;
+static uint64_t num_ops = 100000;
+static uint64_t target = 1000;
+
+static void app_error(const char *fmt, ...)
+  __attribute__((format(printf, 1, 2), noreturn));
+
+/* --=[ random numbers ]=--------------------------------------------------- */
+
+static uint64_t rng_state = 0x9E3779B97F4A7C15ULL;
+
+/* xorshift64*, good enough and the same on every libc */
+static inline uint64_t rng(void) {
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+/* Uniform in [0, 1) */
+static inline double rng_double(void) {
+  return (rng() >> 11) * 0x1.0p-53;
+}
+
+/* Uniform in [lo, hi] */
+static inline uint64_t rng_range(uint64_t lo, uint64_t hi) {
+  return lo + rng() % (hi - lo + 1);
+}
+
+/* --=[ sizes ]=------------------------------------------------------------ */
+
+/*
+ * uniform:MIN:MAX        - every size in [MIN, MAX] as likely
+ * power:MIN:MAX:ALPHA    - bounded Pareto, P(size > x) ~ x^-ALPHA
+ * bimodal:SMALL:LARGE:P  - about SMALL with probability P, else about LARGE
+ *                          (each within 25% of the mode)
+ */
+static void parse_sizes(const char *arg) {
+  char name[16];
+  int n = sscanf(arg, "%15[a-z]:%lf:%lf:%lf", name, &size_a, &size_b, &size_c);
+
+  if (n >= 3 && strcmp(name, "uniform") == 0)
+    size_dist = UNIFORM;
+  else if (n == 4 && strcmp(name, "power") == 0)
+    size_dist = POWER;
+  else if (n == 4 && strcmp(name, "bimodal") == 0)
+    size_dist = BIMODAL;
+  else
+    app_error("bad size distribution: %s\n", arg);
+  if (size_a < 1 || size_b < size_a)
+    app_error("sizes must be at least 1 and in increasing order\n");
+}
+
+static uint64_t random_size(void) {
+  switch (size_dist) {
+    case UNIFORM:
+      return rng_range(size_a, size_b);
+
+    case POWER: {
+      /* inverse of the CDF of the Pareto distribution bounded to [a, b] */
+      double u = rng_double();
+      double la = pow(size_a, -size_c), lb = pow(size_b, -size_c);
+      return (uint64_t)pow(la - u * (la - lb), -1 / size_c);
+    }
+
+    case BIMODAL: {
+      double mode = rng_double() < size_c ? size_a : size_b;
+      return rng_range(mode * 0.75 > 1 ? mode * 0.75 : 1, mode * 1.25);
+    }
+  }
+  return 0;
+}
+
+/* --=[ live blocks ]=------------------------------------------------------ */
+
+/* Live blocks in allocation order, in a ring buffer, so that the oldest and
+ * the youngest can be taken in O(1). Long-lived blocks are not in here. */
+static int32_t *ring;
+static uint64_t ring_len; /* a power of two */
+static uint64_t head, tail;
+
+static uint64_t *sizes;    /* current size, by block id */
+static int32_t *free_ids;  /* ids that can be reused */
+static int32_t num_free_ids;
+static int32_t *kept;      /* long-lived blocks */
+static int32_t num_kept;
+static int32_t num_ids;
+static uint64_t live;      /* including long-lived blocks */
+
+static void *grow(void *array, size_t len, size_t elem) {
+  if ((array = realloc(array, len * elem)) == NULL)
+    app_error("out of memory\n");
+  return array;
+}
+
+static int32_t new_id(void) {
+  if (num_free_ids > 0)
+    return free_ids[--num_free_ids];
+  if (num_ids == INT32_MAX)
+    app_error("too many live blocks\n");
+  if ((num_ids & (num_ids - 1)) == 0) {
+    sizes = grow(sizes, 2 * num_ids + 1, sizeof(*sizes));
+    free_ids = grow(free_ids, 2 * num_ids + 1, sizeof(*free_ids));
+    kept = grow(kept, 2 * num_ids + 1, sizeof(*kept));
+  }
+  return num_ids++;
+}
+
+static void ring_push(int32_t id) {
+  if (tail - head == ring_len) {
+    /* unwrap into a twice as large ring */
+    int32_t *bigger = malloc(2 * ring_len * sizeof(*ring));
+    if (bigger == NULL)
+      app_error("out of memory\n");
+    for (uint64_t i = head; i < tail; i++)
+      bigger[i - head] = ring[i & (ring_len - 1)];
+    free(ring);
+    ring = bigger;
+    tail -= head;
+    head = 0;
+    ring_len *= 2;
+  }
+  ring[tail++ & (ring_len - 1)] = id;
+}
+
+/* Remove and return a block picked by the lifetime policy */
+static int32_t ring_take(void) {
+  switch (lifetime) {
+    case LIFO:
+      return ring[--tail & (ring_len - 1)];
+
+    case FIFO:
+      return ring[head++ & (ring_len - 1)];
+
+    default: {
+      /* the youngest block takes the place of the picked one */
+      uint64_t i = head + rng() % (tail - head);
+      int32_t id = ring[i & (ring_len - 1)];
+      ring[i & (ring_len - 1)] = ring[--tail & (ring_len - 1)];
+      return id;
+    }
+  }
+}
+
+/* --=[ output ]=----------------------------------------------------------- */
+
+static FILE *out;
+static int binary;
+
+static void emit(uint16_t type, int32_t index, uint64_t size) {
+  if (binary) {
+    traceop_t op = {.type = type,
+                    .align = type == MEMALIGN ? align_log2 : 0,
+                    .index = index,
+                    .size = size};
+    fwrite(&op, sizeof(op), 1, out);
+  } else if (type == FREE) {
+    fprintf(out, "f %d\n", index);
+  } else if (type == MEMALIGN) {
+    fprintf(out, "m %d %lu %lu\n", index, 1UL << align_log2,
+            (unsigned long)size);
+  } else {
+    fprintf(out, "%c %d %lu\n", type == ALLOC ? 'a' : 'r', index,
+            (unsigned long)size);
+  }
+}
+
+/* Written once before the requests and again, with num_ids, at the end. The
+ * text header has fixed-width fields, so it takes the same space both times. */
+static void write_header(void) {
+  int ignore_ranges = num_ops > RANGES_MAX_OPS;
+
+  rewind(out);
+  if (binary) {
+    tracehdr_t hdr = {TRACE_MAGIC, TRACE_VERSION, 1, num_ids, num_ops,
+                      ignore_ranges, {0, 0, 0}};
+    fwrite(&hdr, sizeof(hdr), 1, out);
+  } else {
+    fprintf(out, "1\n%10d\n%10lu\n%d\n", num_ids, (unsigned long)num_ops,
+            ignore_ranges);
+  }
+}
+
+/* --=[ generator ]=-------------------------------------------------------- */
+
+/* Realloc the youngest block (LIFO) or a random one */
+static void regrow_block(uint64_t freeable) {
+  int32_t id;
+
+  if (freeable == 0)
+    id = kept[rng() % num_kept];
+  else if (lifetime == LIFO)
+    id = ring[(tail - 1) & (ring_len - 1)];
+  else
+    id = ring[(head + rng() % freeable) & (ring_len - 1)];
+
+  uint64_t size = sizes[id];
+  switch (regrow) {
+    case REGROW_RANDOM:
+      size = random_size();
+      break;
+    case REGROW_LINEAR:
+      size += regrow_step;
+      break;
+    case REGROW_GEOMETRIC:
+      size *= regrow_step;
+      break;
+  }
+  /* a block that keeps growing starts over */
+  if (size > MAX_REGROW_SIZE)
+    size = random_size();
+  sizes[id] = size;
+  emit(REALLOC, id, size);
+}
+
+static void generate(void) {
+  uint64_t op = 0;
+
+  ring_len = 1024;
+  ring = malloc(ring_len * sizeof(*ring));
+  if (ring == NULL)
+    app_error("out of memory\n");
+
+  /*
+   * Stop when the requests left are just enough to free every live block.
+   * A free does not change that margin, an alloc takes two requests from it
+   * and a realloc one, so the last step before the end is a realloc when the
+   * margin is odd.
+   */
+  while (op + live < num_ops) {
+    uint64_t room = num_ops - op - live;
+    uint64_t freeable = tail - head;
+
+    if (room == 1 || (freeable > 0 && rng_double() < realloc_fraction)) {
+      regrow_block(freeable);
+    } else if (freeable == 0 || rng_double() * (target + live) < target) {
+      int32_t id = new_id();
+      sizes[id] = random_size();
+      emit(rng_double() < aligned_fraction ? MEMALIGN : ALLOC, id, sizes[id]);
+      live++;
+      if (lifetime == LONG_LIVED && rng_double() < long_fraction)
+        kept[num_kept++] = id;
+      else
+        ring_push(id);
+    } else {
+      int32_t id = ring_take();
+      emit(FREE, id, 0);
+      free_ids[num_free_ids++] = id;
+      live--;
+    }
+    op++;
+  }
+
+  /* free every block that is left, the long-lived ones included */
+  while (tail > head)
+    emit(FREE, ring[head++ & (ring_len - 1)], 0);
+  while (num_kept > 0)
+    emit(FREE, kept[--num_kept], 0);
+}
+
+static void usage(void) {
+  fprintf(stderr,
+          "Usage: tracegen [-n <ops>] [-t <live blocks>] [-s <sizes>] "
+          "[-l <lifetime>] [-r <fraction>[:<growth>]] [-a <fraction>:<align>] "
+          "[-S <seed>] -o <file>\n"
+          "\t-n <ops>     Number of requests (default 100000).\n"
+          "\t-t <n>       Live blocks to aim for (default 1000).\n"
+          "\t-s <sizes>   uniform:MIN:MAX (default 16:4096), "
+          "power:MIN:MAX:ALPHA or bimodal:SMALL:LARGE:P.\n"
+          "\t-l <policy>  Free order: lifo, fifo, random (default) or "
+          "long:F, random with a fraction F of blocks never freed.\n"
+          "\t-r <f>[:<g>] Realloc in a fraction f of the steps, to a new "
+          "random size, or growing by +N or xF (e.g. 0.1:+64 or 0.1:x1.5).\n"
+          "\t-a <f>:<a>   Make a fraction f of the allocations with "
+          "memalign(a, size).\n"
+          "\t-S <seed>    Seed of the random numbers.\n"
+          "\t-o <file>    Output, binary if it ends with .bin.\n");
+}
+
+int main(int argc, char **argv) {
+  const char *name = NULL;
+  int c;
+
+  while ((c = getopt(argc, argv, "n:t:s:l:r:a:S:o:h")) != -1) {
+    switch (c) {
+      case 'n':
+        num_ops = strtoull(optarg, NULL, 0);
+        if (num_ops < 2 || num_ops > UINT32_MAX)
+          app_error("-n must be between 2 and %u\n", UINT32_MAX);
+        break;
+
+      case 't':
+        target = strtoull(optarg, NULL, 0);
+        if (target == 0)
+          app_error("-t must be positive\n");
+        break;
+
+      case 's':
+        parse_sizes(optarg);
+        break;
+
+      case 'l':
+        if (strcmp(optarg, "lifo") == 0)
+          lifetime = LIFO;
+        else if (strcmp(optarg, "fifo") == 0)
+          lifetime = FIFO;
+        else if (strcmp(optarg, "random") == 0)
+          lifetime = RANDOM;
+        else if (sscanf(optarg, "long:%lf", &long_fraction) == 1)
+          lifetime = LONG_LIVED;
+        else
+          app_error("bad lifetime policy: %s\n", optarg);
+        break;
+
+      case 'r': {
+        char kind = 0;
+        int n = sscanf(optarg, "%lf:%c%lf", &realloc_fraction, &kind,
+                       &regrow_step);
+        if (n == 3 && kind == '+')
+          regrow = REGROW_LINEAR;
+        else if (n == 3 && kind == 'x' && regrow_step >= 1)
+          regrow = REGROW_GEOMETRIC;
+        else if (n != 1)
+          app_error("bad realloc pattern: %s\n", optarg);
+        break;
+      }
+
+      case 'a': {
+        unsigned long align = 0;
+        if (sscanf(optarg, "%lf:%lu", &aligned_fraction, &align) != 2 ||
+            align == 0 || (align & (align - 1)) != 0 || align > 1UL << 30)
+          app_error("bad aligned allocations: %s\n", optarg);
+        align_log2 = __builtin_ctzl(align);
+        break;
+      }
+
+      case 'S':
+        rng_state = strtoull(optarg, NULL, 0) | 1;
+        break;
+
+      case 'o':
+        name = optarg;
+        break;
+
+      case 'h':
+        usage();
+        return EXIT_SUCCESS;
+
+      default:
+        usage();
+        return EXIT_FAILURE;
+    }
+  }
+
+  if (name == NULL) {
+    usage();
+    return EXIT_FAILURE;
+  }
+
+  size_t len = strlen(name);
+  binary = len > 4 && strcmp(name + len - 4, ".bin") == 0;
+  if ((out = fopen(name, binary ? "wb" : "w")) == NULL)
+    app_error("%s: %s\n", name, strerror(errno));
+
+  write_header();
+  generate();
+  write_header();
+  if (fclose(out) != 0)
+    app_error("%s: %s\n", name, strerror(errno));
+  return EXIT_SUCCESS;
+}
+
+static void app_error(const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+  exit(EXIT_FAILURE);
+}